@@ -0,0 +1,133 @@
+#import "types.h"
+#import "memory.h"
+#import "smp.h"
+#import "thread.h"
+#import "arena.h"
+
+#define ARENA_ALIGNMENT             16                              // Enough for anything we store
+#define SCRATCH_ARENA_BYTES         4096
+
+// Each core's scratch arena for before the scheduler starts, made the first time the core asks for it
+
+static arena *scratch_arenas[CORE_COUNT];
+
+// Local functions
+
+static uint64 align(uint64 size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~((uint64) ARENA_ALIGNMENT - 1);
+}
+
+static arena_chunk *new_chunk(arena_chunk *previous, uint64 size) {
+    // Use the whole block the memory code gives us, it may be bigger than we asked for
+
+    arena_chunk *chunk = allocate_uninitialized(size);
+
+    chunk->previous = previous;
+    chunk->end = (uint8 *) chunk + memory_block_size(chunk);
+
+    return chunk;
+}
+
+static void add_chunk(arena *a, uint64 size) {
+    // Anything bigger than our usual chunks gets a chunk of its own size
+
+    uint64 needed = align(sizeof(arena_chunk)) + size;
+
+    a->chunk = new_chunk(a->chunk, needed > a->chunk_size ? needed : a->chunk_size);
+    a->next = (uint8 *) a->chunk + align(sizeof(arena_chunk));
+}
+
+// Functions
+
+arena *create_arena(uint64 chunk_size) {
+    // The arena struct is the first thing in its first chunk
+
+    arena_chunk *chunk = new_chunk(null, chunk_size);
+    arena *a = (arena *) ((uint8 *) chunk + align(sizeof(arena_chunk)));
+
+    a->chunk = chunk;
+    a->next = (uint8 *) a + align(sizeof(arena));
+    a->last = null;
+    a->chunk_size = chunk_size;
+
+    return a;
+}
+
+void destroy_arena(arena **a) {
+    // Free everything but the first chunk, then the first chunk which holds the arena itself
+
+    arena_chunk *chunk = (*a)->chunk;
+
+    while (chunk->previous != null) {
+        arena_chunk *previous = chunk->previous;
+
+        free((void **) &chunk);
+
+        chunk = previous;
+    }
+
+    free((void **) &chunk);
+
+    *a = null;
+}
+
+void *allocate_from_arena(arena *a, uint64 size) {
+    size = align(size);
+
+    if (size > (uint64) (a->chunk->end - a->next))
+        add_chunk(a, size);
+
+    a->last = a->next;
+    a->next += size;
+
+    return a->last;
+}
+
+void *resize_in_arena(arena *a, void *ptr, uint64 size, uint64 used) {
+    // If it was the last thing allocated and there's room left in the chunk, just move the end
+
+    if (ptr == a->last && align(size) <= (uint64) (a->chunk->end - a->last)) {
+        a->next = a->last + align(size);
+        return ptr;
+    }
+
+    // Otherwise copy it, the old space comes back when the arena is reset
+
+    void *result = allocate_from_arena(a, size);
+
+    copy_memory(ptr, result, used < size ? used : size);
+
+    return result;
+}
+
+arena_mark mark_arena(arena *a) {
+    return (arena_mark) { .chunk = a->chunk, .next = a->next };
+}
+
+void reset_arena(arena *a, arena_mark mark) {
+    // Free any chunks added since the mark, then go back to where we were in the mark's chunk
+
+    while (a->chunk != mark.chunk) {
+        arena_chunk *previous = a->chunk->previous;
+
+        free((void **) &a->chunk);
+
+        a->chunk = previous;
+    }
+
+    a->next = mark.next;
+    a->last = null;
+}
+
+arena *scratch_arena() {
+    // Once there are threads each has its own, since a thread can be switched out (or moved to another
+    // core) between marking the arena and resetting it, and whatever ran next would be using it too
+
+    thread *current = current_thread();
+    arena **scratch = current != null ? &current->scratch : &scratch_arenas[this_core()->core];
+
+    if (*scratch == null)
+        *scratch = create_arena(SCRATCH_ARENA_BYTES);
+
+    return *scratch;
+}
@@ -0,0 +1,50 @@
+#include "types.h"
+
+#ifndef __arena_h__
+#define	__arena_h__
+
+// An arena hands out memory by bumping a pointer through big blocks (chunks) from the memory code,
+// and frees it all at once. Good for temporary work that all dies together.
+
+typedef struct arena_chunk {
+    struct arena_chunk *previous;       // The chunk we filled before this one, null for the first
+    uint8 *end;                         // The first address past the chunk
+} arena_chunk;
+
+typedef struct {
+    arena_chunk *chunk;                 // The chunk we're allocating from
+    uint8 *next;                        // Where the next allocation starts
+    uint8 *last;                        // Where the last allocation started, so it can grow in place
+    uint64 chunk_size;                  // How big a chunk to ask for when we run out
+} arena;
+
+// Somewhere to go back to with reset_arena()
+typedef struct {
+    arena_chunk *chunk;
+    uint8 *next;
+} arena_mark;
+
+// Creates an arena that gets chunk_size bytes at a time, the arena itself lives in the first chunk
+arena *create_arena(uint64 chunk_size);
+
+// Frees every chunk of the arena and nulls out the pointer
+void destroy_arena(arena **a);
+
+// Returns size bytes from the arena, they aren't zeroed
+void *allocate_from_arena(arena *a, uint64 size);
+
+// Resizes an allocation from the arena, keeping the first used bytes. The last allocation grows in place
+// if there's room, anything else is copied to a new allocation.
+void *resize_in_arena(arena *a, void *ptr, uint64 size, uint64 used);
+
+// Remembers where the arena is up to
+arena_mark mark_arena(arena *a);
+
+// Frees everything allocated from the arena since the mark was taken
+void reset_arena(arena *a, arena_mark mark);
+
+// This thread's arena for temporary work (this core's before there are threads), mark it before using it
+// and reset it when done
+arena *scratch_arena();
+
+#endif
@@ -0,0 +1,610 @@
+#import "types.h"
+#import "uart.h"
+#import "memory.h"
+#import "string.h"
+#import "benchmark.h"
+#import "smp.h"
+#import "string_ops.h"
+#import "irq.h"
+#import "timer.h"
+#import "thread.h"
+#import "idle.h"
+
+#define BENCHMARK_ROUNDS            8
+#define BANDWIDTH_BYTES             (1 << 20)                       // How much each bandwidth size moves in total
+#define SCALING_BLOCKS              32                              // How many blocks each core holds at once
+#define SCALING_ROUNDS              2000                            // How many times each core allocates and frees them
+#define LINE_PIECES                 64                              // How many pieces each built line has
+#define SEARCH_ROUNDS               100                             // How many times each search kernel is timed
+#define UART_LINES                  256                             // How many lines the UART benchmark sends
+#define TIMER_INTERRUPTS            100                             // How many timer IRQs the latency benchmark takes
+#define TIMER_DELAY_TICKS           1000                            // How far ahead each one is set
+#define SWITCH_ROUNDS               10000                           // How many times each switching thread yields
+#define WORK_THREADS                16                              // How many threads share the CPU-bound work
+#define WORK_ROUNDS                 (1 << 22)                       // How much of the work each one does
+#define SLEEP_ROUNDS                20                              // How many times the idle benchmark sleeps
+#define SLEEP_MICROSECONDS          5000                            // And for how long each time
+
+// Local functions
+
+static void reference_zero_memory(void *ptr, uint64 size) {
+    // The C zero_memory() from before memory_ops.S, to compare against
+
+    for (uint64 i = 0; i < size / 8; i++)
+        ((uint64 *) ptr)[i] = 0;
+
+    for (uint64 i = size & ~7ULL; i < size; i++)
+        ((uint8 *) ptr)[i] = 0;
+}
+
+static void reference_copy_memory(void *src, void *dest, uint64 size) {
+    // The C copy_memory() from before memory_ops.S, to compare against
+
+    for (uint64 i = 0; i < size / 8; i++)
+        ((uint64 *) dest)[i] = ((uint64 *) src)[i];
+
+    for (uint64 i = size & ~7ULL; i < size; i++)
+        ((uint8 *) dest)[i] = ((uint8 *) src)[i];
+}
+
+static uint64 per_kilocycle(uint64 count, uint64 cycles) {
+    return cycles == 0 ? 0 : count * 1000 / cycles;
+}
+
+static void benchmark_memory_bandwidth() {
+    // Zero and copy each size enough times to move BANDWIDTH_BYTES, old C loops versus memory_ops.S
+
+    uint64 sizes[] = {8, 64, 512, 4096, 16384, 65536, 262144, 1048576};
+
+    void *source = allocate_pages(BANDWIDTH_BYTES);
+    void *destination = allocate_pages(BANDWIDTH_BYTES);
+
+    uart_printf(LITERAL("Bytes per 1000 cycles, old C -> memory_ops.S\n"));
+
+    for (uint8 i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint64 repeats = BANDWIDTH_BYTES / sizes[i];
+        uint64 cycles[4];
+        uint64 start;
+
+        start = read_cycle_counter();
+        for (uint64 r = 0; r < repeats; r++)
+            reference_zero_memory(destination, sizes[i]);
+        cycles[0] = read_cycle_counter() - start;
+
+        start = read_cycle_counter();
+        for (uint64 r = 0; r < repeats; r++)
+            zero_memory(destination, sizes[i]);
+        cycles[1] = read_cycle_counter() - start;
+
+        start = read_cycle_counter();
+        for (uint64 r = 0; r < repeats; r++)
+            reference_copy_memory(source, destination, sizes[i]);
+        cycles[2] = read_cycle_counter() - start;
+
+        start = read_cycle_counter();
+        for (uint64 r = 0; r < repeats; r++)
+            copy_memory(source, destination, sizes[i]);
+        cycles[3] = read_cycle_counter() - start;
+
+        uart_printf(LITERAL("%u: zero %u -> %u, copy %u -> %u\n"), sizes[i],
+                    per_kilocycle(BANDWIDTH_BYTES, cycles[0]),
+                    per_kilocycle(BANDWIDTH_BYTES, cycles[1]),
+                    per_kilocycle(BANDWIDTH_BYTES, cycles[2]),
+                    per_kilocycle(BANDWIDTH_BYTES, cycles[3]));
+    }
+
+    free(&source);
+    free(&destination);
+}
+
+static void benchmark_zeroed_allocations() {
+    // Time grabbing 16k blocks. Nothing has been zeroed ahead of time yet since the idle loop hasn't run,
+    // so the first round pays for zeroing in allocate().
+
+    void *blocks[BENCHMARK_ROUNDS];
+    uint64 zeroing = 0;
+    uint64 prezeroed = 0;
+    uint64 uninitialized = 0;
+
+    for (uint8 i = 0; i < BENCHMARK_ROUNDS; i++) {
+        uint64 start = read_cycle_counter();
+        blocks[i] = allocate(16384);
+        zeroing += read_cycle_counter() - start;
+    }
+
+    for (uint8 i = 0; i < BENCHMARK_ROUNDS; i++)
+        free(&blocks[i]);
+
+    // Now let the idle work zero some blocks first
+
+    while (prepare_zeroed_blocks()) {};
+
+    for (uint8 i = 0; i < BENCHMARK_ROUNDS; i++) {
+        uint64 start = read_cycle_counter();
+        blocks[i] = allocate(16384);
+        prezeroed += read_cycle_counter() - start;
+    }
+
+    for (uint8 i = 0; i < BENCHMARK_ROUNDS; i++)
+        free(&blocks[i]);
+
+    // And finally skip zeroing entirely
+
+    for (uint8 i = 0; i < BENCHMARK_ROUNDS; i++) {
+        uint64 start = read_cycle_counter();
+        blocks[i] = allocate_uninitialized(16384);
+        uninitialized += read_cycle_counter() - start;
+    }
+
+    for (uint8 i = 0; i < BENCHMARK_ROUNDS; i++)
+        free(&blocks[i]);
+
+    report_benchmark("16k allocate, zeroing", zeroing / BENCHMARK_ROUNDS, "cycles");
+    report_benchmark("16k allocate, pre-zeroed", prezeroed / BENCHMARK_ROUNDS, "cycles");
+    report_benchmark("16k allocate_uninitialized", uninitialized / BENCHMARK_ROUNDS, "cycles");
+}
+
+static void benchmark_allocate_and_format() {
+    // Plain allocator and formatting work, build with NO_MMU=1 to see what the MMU and caches are worth
+
+    uint64 start = read_cycle_counter();
+
+    for (uint16 i = 0; i < 1000; i++) {
+        void *block = allocate(64);
+        free(&block);
+    }
+
+    report_benchmark("64 byte allocate + free", (read_cycle_counter() - start) / 1000, "cycles");
+
+    string *format = LITERAL("%d %x %s");
+    string *text = LITERAL("text");
+
+    // Warm up the scratch arena first so we only count what each call costs
+
+    string *result = format_string(format, -12345, 0xABCD, text);
+    free((void **) &result);
+
+    uint64 allocations = allocation_count;
+
+    start = read_cycle_counter();
+
+    for (uint16 i = 0; i < 100; i++) {
+        result = format_string(format, -12345, 0xABCD, text);
+        free((void **) &result);
+    }
+
+    report_benchmark("format_string", (read_cycle_counter() - start) / 100, "cycles");
+    report_benchmark("format_string allocations", (allocation_count - allocations) / 100, "per call");
+
+    // The same format compiled once and rendered each time
+
+    compiled_format *compiled = compile_format(format);
+
+    allocations = allocation_count;
+    start = read_cycle_counter();
+
+    for (uint16 i = 0; i < 100; i++) {
+        result = render_format(compiled, -12345, 0xABCD, text);
+        free((void **) &result);
+    }
+
+    report_benchmark("render_format", (read_cycle_counter() - start) / 100, "cycles");
+    report_benchmark("render_format allocations", (allocation_count - allocations) / 100, "per call");
+
+    free((void **) &compiled);
+}
+
+static void benchmark_string_building() {
+    // Build the same line from LINE_PIECES pieces, first by appending strings two at a time, then with a builder
+
+    string *piece = LITERAL("piece, ");
+    uint64 allocations = allocation_count;
+    uint64 start = read_cycle_counter();
+
+    string *line = empty_string(0);
+
+    for (uint16 i = 0; i < LINE_PIECES; i++) {
+        string *longer = append_strings(line, piece);
+        free((void **) &line);
+        line = longer;
+    }
+
+    report_benchmark("append_strings line", read_cycle_counter() - start, "cycles");
+    report_benchmark("append_strings allocations", allocation_count - allocations, "per line");
+
+    free((void **) &line);
+
+    allocations = allocation_count;
+    start = read_cycle_counter();
+
+    string_builder b = start_builder(16);
+
+    for (uint16 i = 0; i < LINE_PIECES; i++)
+        append_string(&b, piece);
+
+    line = finish_builder(&b);
+
+    report_benchmark("string_builder line", read_cycle_counter() - start, "cycles");
+    report_benchmark("string_builder allocations", allocation_count - allocations, "per line");
+
+    free((void **) &line);
+}
+
+static void benchmark_string_search() {
+    // Time each search and compare kernel on text that only differs (or matches) at the very end
+
+    uint16 sizes[] = {16, 256, 16384};
+
+    uint8 *one = allocate_pages(16384 + 1);
+    uint8 *two = allocate_pages(16384 + 1);
+    uint8 pattern[] = {'a', 'b', 'z'};
+
+    uart_printf(LITERAL("Cycles per call: length, compare, compare ignoring case, find byte, find bytes\n"));
+
+    for (uint8 i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint16 size = sizes[i];
+        uint64 cycles[5];
+        uint64 start;
+
+        for (uint16 b = 0; b < size; b++) {
+            one[b] = 'a' + b % 3;
+            two[b] = 'A' + b % 3;
+        }
+
+        one[size - 1] = 'z';
+        two[size - 1] = 'Z';
+        one[size] = 0;
+
+        start = read_cycle_counter();
+        for (uint16 r = 0; r < SEARCH_ROUNDS; r++)
+            cstring_length((char *) one);
+        cycles[0] = read_cycle_counter() - start;
+
+        start = read_cycle_counter();
+        for (uint16 r = 0; r < SEARCH_ROUNDS; r++)
+            compare_bytes(one, one, size);
+        cycles[1] = read_cycle_counter() - start;
+
+        start = read_cycle_counter();
+        for (uint16 r = 0; r < SEARCH_ROUNDS; r++)
+            compare_bytes_ignoring_case(one, two, size);
+        cycles[2] = read_cycle_counter() - start;
+
+        start = read_cycle_counter();
+        for (uint16 r = 0; r < SEARCH_ROUNDS; r++)
+            find_byte(one, size, 'z');
+        cycles[3] = read_cycle_counter() - start;
+
+        start = read_cycle_counter();
+        for (uint16 r = 0; r < SEARCH_ROUNDS; r++)
+            find_bytes(one, size, pattern, sizeof(pattern));
+        cycles[4] = read_cycle_counter() - start;
+
+        uart_printf(LITERAL("%u: %u, %u, %u, %u, %u\n"), size, cycles[0] / SEARCH_ROUNDS, cycles[1] / SEARCH_ROUNDS,
+                    cycles[2] / SEARCH_ROUNDS, cycles[3] / SEARCH_ROUNDS, cycles[4] / SEARCH_ROUNDS);
+    }
+
+    free_pages((void **) &one);
+    free_pages((void **) &two);
+}
+
+static void benchmark_uart_throughput() {
+    // Send UART_LINES lines and time them until the last byte is in the UART's FIFO. It's timed with the
+    // generic timer instead of cycles since the UART's clock has nothing to do with the CPU's. Each line ends
+    // in a carriage return so they all land on top of each other.
+
+    string *line = LITERAL("Sending as fast as the UART will take it, this line goes out over and over again\r");
+    uint64 frequency = timer_frequency();
+
+    uart_flush();
+
+    uint64 start = read_timer();
+
+    for (uint16 i = 0; i < UART_LINES; i++)
+        uart_send_string(line);
+
+    uart_flush();
+
+    uint64 ticks = read_timer() - start;
+    uint64 bytes = (uint64) UART_LINES * (line->size - 2);
+
+    uart_send_char('\n');
+
+    report_benchmark("UART send", ticks == 0 ? 0 : bytes * frequency / ticks, "bytes per second");
+}
+
+static volatile uint32 timer_interrupts;
+static uint64 timer_late_ticks;
+static uint64 timer_most_late_ticks;
+
+static void timer_latency_handler(void *unused) {
+    // How long after the timer was due did we get here, then turn it off so it stops asking
+
+    uint64 due;
+    uint64 now;
+
+    asm volatile ("mrs %0, cntv_cval_el0" : "=r" (due));
+    asm volatile ("isb\n\tmrs %0, cntvct_el0" : "=r" (now));
+
+    uint64 late = now - due;
+
+    asm volatile ("msr cntv_ctl_el0, xzr");
+
+    timer_late_ticks += late;
+
+    if (late > timer_most_late_ticks)
+        timer_most_late_ticks = late;
+
+    timer_interrupts++;
+}
+
+static void benchmark_irq_latency() {
+    // Set this core's virtual timer (the scheduler has the physical one) TIMER_INTERRUPTS times and see how
+    // long after it's due the handler runs. The timer only ticks at a few tens of MHz, the cycles from the
+    // vector table to the handler come from the IRQ statistics.
+
+    uint64 frequency = timer_frequency();
+
+    irq_statistics before = read_irq_statistics(IRQ_LOCAL_VIRTUAL_TIMER);
+
+    register_irq_handler(IRQ_LOCAL_VIRTUAL_TIMER, timer_latency_handler, null);
+    enable_irq_line(IRQ_LOCAL_VIRTUAL_TIMER);
+
+    timer_interrupts = 0;
+    timer_late_ticks = 0;
+    timer_most_late_ticks = 0;
+
+    for (uint32 i = 0; i < TIMER_INTERRUPTS; i++) {
+        uint64 due;
+
+        asm volatile ("isb\n\tmrs %0, cntvct_el0" : "=r" (due));
+
+        due += TIMER_DELAY_TICKS;
+
+        asm volatile ("msr cntv_cval_el0, %0" : : "r" (due));
+        asm volatile ("msr cntv_ctl_el0, %0\n\tisb" : : "r" (1ULL));   // Enabled and not masked
+
+        while (timer_interrupts == i) {};
+    }
+
+    disable_irq_line(IRQ_LOCAL_VIRTUAL_TIMER);
+
+    irq_statistics after = read_irq_statistics(IRQ_LOCAL_VIRTUAL_TIMER);
+
+    report_benchmark("Timer IRQ latency", timer_late_ticks * 1000000000 / frequency / TIMER_INTERRUPTS, "ns");
+    report_benchmark("Timer IRQ most latency", timer_most_late_ticks * 1000000000 / frequency, "ns");
+    report_benchmark("IRQ vector to handler", (after.total_cycles - before.total_cycles) / TIMER_INTERRUPTS,
+                     "cycles");
+
+    report_irq_statistics();
+}
+
+static void allocation_worker(void *unused) {
+    // Hold a handful of small blocks of mixed sizes at a time, enough to go past the magazines now and then
+
+    void *blocks[SCALING_BLOCKS];
+
+    for (uint32 round = 0; round < SCALING_ROUNDS; round++) {
+        for (uint8 i = 0; i < SCALING_BLOCKS; i++)
+            blocks[i] = allocate(64 << (i % 4));
+
+        for (uint8 i = 0; i < SCALING_BLOCKS; i++)
+            free(&blocks[i]);
+    }
+}
+
+static void benchmark_allocation_scaling() {
+    // Run the same allocate/free work on 1 to 4 cores at once, timed on this core until they've all finished.
+    // With the per-core magazines the throughput should go up with each core.
+
+    char *names[CORE_COUNT] = {"1 core allocate + free", "2 core allocate + free",
+                               "3 core allocate + free", "4 core allocate + free"};
+
+    for (uint8 cores = 1; cores <= CORE_COUNT; cores++) {
+        thread *workers[CORE_COUNT];
+        uint64 start = read_cycle_counter();
+
+        for (uint8 core = 1; core < cores; core++)
+            workers[core] = create_thread(allocation_worker, null, 1 << core);
+
+        allocation_worker(null);
+
+        for (uint8 core = 1; core < cores; core++)
+            join_thread(&workers[core]);
+
+        uint64 cycles = read_cycle_counter() - start;
+        uint64 operations = (uint64) cores * SCALING_ROUNDS * SCALING_BLOCKS * 2;
+
+        report_benchmark(names[cores - 1], per_kilocycle(operations, cycles), "operations per 1000 cycles");
+    }
+}
+
+static void switching_worker(void *unused) {
+    for (uint32 round = 0; round < SWITCH_ROUNDS; round++)
+        yield();
+}
+
+static void benchmark_context_switch() {
+    // Two threads on this core yielding to each other (we're asleep in join_thread()), so every yield is a
+    // switch
+
+    thread *one = create_thread(switching_worker, null, 1 << this_core()->core);
+    thread *two = create_thread(switching_worker, null, 1 << this_core()->core);
+    uint64 switches = thread_switches();
+    uint64 start = read_cycle_counter();
+
+    join_thread(&one);
+    join_thread(&two);
+
+    uint64 cycles = read_cycle_counter() - start;
+
+    report_benchmark("Context switch", cycles / (thread_switches() - switches), "cycles");
+}
+
+static void cpu_bound_worker(void *result) {
+    // Nothing but arithmetic, an xorshift generator run WORK_ROUNDS times
+
+    uint64 x = (uint64) result | 1;
+
+    for (uint32 round = 0; round < WORK_ROUNDS; round++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+
+    *(uint64 *) result = x;
+}
+
+static void benchmark_thread_scaling() {
+    // The same WORK_THREADS threads allowed on 1 to 4 cores. They're all queued on this core, the others
+    // have to steal them. Timed with the generic timer, since it's the same on every core.
+
+    char *names[CORE_COUNT] = {"1 core CPU-bound threads", "2 core CPU-bound threads",
+                               "3 core CPU-bound threads", "4 core CPU-bound threads"};
+
+    uint64 results[WORK_THREADS];
+    uint8 most_cores = CORE_COUNT;
+
+#ifdef NO_MMU
+    most_cores = 1;                                                 // Only the main core runs threads
+#endif
+
+    for (uint8 cores = 1; cores <= most_cores; cores++) {
+        thread *workers[WORK_THREADS];
+        uint64 start = read_timer();
+
+        for (uint8 i = 0; i < WORK_THREADS; i++)
+            workers[i] = create_thread(cpu_bound_worker, &results[i], (1 << cores) - 1);
+
+        for (uint8 i = 0; i < WORK_THREADS; i++)
+            join_thread(&workers[i]);
+
+        uint64 microseconds = (read_timer() - start) * 1000000 / timer_frequency();
+
+        report_benchmark(names[cores - 1], microseconds, "us");
+    }
+}
+
+static void benchmark_idle() {
+    // Sleep with nothing else to run, so every core is idle. How late each wake up is shows what the WFI
+    // and the timer cost us. With no regular tick it should take one timer IRQ per sleep, on this core, and
+    // the cores should be idle for almost all of it.
+
+    char *names[CORE_COUNT] = {"Core 0 idle while sleeping", "Core 1 idle while sleeping",
+                               "Core 2 idle while sleeping", "Core 3 idle while sleeping"};
+
+    uint64 frequency = timer_frequency();
+    uint64 sleep_ticks = SLEEP_MICROSECONDS * frequency / 1000000;
+    uint64 late_ticks = 0;
+    uint64 most_late_ticks = 0;
+    core_times before[CORE_COUNT];
+
+    irq_statistics timer_before = read_irq_statistics(IRQ_LOCAL_PHYSICAL_TIMER);
+
+    uart_flush();                                                   // Or its interrupts would wake us
+
+    for (uint8 core = 0; core < CORE_COUNT; core++)
+        before[core] = read_core_times(core);
+
+    for (uint32 round = 0; round < SLEEP_ROUNDS; round++) {
+        uint64 due = read_timer() + sleep_ticks;
+
+        sleep_thread(SLEEP_MICROSECONDS);
+
+        uint64 late = read_timer() - due;
+
+        late_ticks += late;
+
+        if (late > most_late_ticks)
+            most_late_ticks = late;
+    }
+
+    core_times after[CORE_COUNT];
+
+    for (uint8 core = 0; core < CORE_COUNT; core++)
+        after[core] = read_core_times(core);
+
+    irq_statistics timer_after = read_irq_statistics(IRQ_LOCAL_PHYSICAL_TIMER);
+
+    report_benchmark("Sleep wake up latency", late_ticks * 1000000000 / frequency / SLEEP_ROUNDS, "ns");
+    report_benchmark("Sleep most wake up latency", most_late_ticks * 1000000000 / frequency, "ns");
+    report_benchmark("Timer IRQs per sleep", (timer_after.count - timer_before.count) / SLEEP_ROUNDS, "");
+
+    for (uint8 core = 0; core < CORE_COUNT; core++) {
+        uint64 idle = after[core].idle_ticks - before[core].idle_ticks;
+        uint64 total = idle + after[core].busy_ticks - before[core].busy_ticks;
+
+        if (total > 0)
+            report_benchmark(names[core], idle * 100 / total, "%");
+    }
+}
+
+// Functions
+
+void init_cycle_counter() {
+    // Enable the performance monitors and reset the cycle counter (PMCR_EL0 bits 0 and 2),
+    // then turn the cycle counter on (PMCNTENSET_EL0 bit 31)
+
+    uint64 control;
+
+    asm volatile ("mrs %0, pmcr_el0" : "=r" (control));
+
+    control |= 0x5;
+
+    asm volatile ("msr pmcr_el0, %0" : : "r" (control));
+    asm volatile ("msr pmcntenset_el0, %0" : : "r" (0x80000000ULL));
+    asm volatile ("isb");
+}
+
+uint64 read_cycle_counter() {
+    uint64 cycles;
+
+    // The ISB stops the read from being done early, before the code we're timing finishes
+
+    asm volatile ("isb\n\tmrs %0, pmccntr_el0" : "=r" (cycles));
+
+    return cycles;
+}
+
+void report_benchmark(char name[], uint64 value, char units[]) {
+    string *label = string_from_cstring(name);
+    string *number = format_string(LITERAL(": %u "), value);
+    string *suffix = string_from_cstring(units);
+
+    uart_send_string(label);
+    uart_send_string(number);
+    uart_send_string(suffix);
+    uart_send_char('\n');
+
+    free((void **) &label);
+    free((void **) &number);
+    free((void **) &suffix);
+}
+
+void run_benchmarks() {
+    init_cycle_counter();
+
+#ifdef NO_MMU
+    report_benchmark("MMU and caches on", 0, "");
+#else
+    report_benchmark("MMU and caches on", 1, "");
+#endif
+
+    benchmark_allocate_and_format();
+    benchmark_string_building();
+    benchmark_string_search();
+    benchmark_zeroed_allocations();
+    benchmark_memory_bandwidth();
+    benchmark_uart_throughput();
+    benchmark_irq_latency();
+    benchmark_context_switch();
+    benchmark_thread_scaling();
+    benchmark_idle();
+
+#ifndef NO_MMU
+    // The locks need the MMU on, without it only the main core can allocate
+    benchmark_allocation_scaling();
+#endif
+
+    report_core_times();
+}
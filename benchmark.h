@@ -0,0 +1,18 @@
+#include "types.h"
+
+#ifndef __benchmark_h__
+#define	__benchmark_h__
+
+// Turns on the CPU's cycle counter
+void init_cycle_counter();
+
+// Reads the number of cycles the CPU has run since init_cycle_counter()
+uint64 read_cycle_counter();
+
+// Sends a line with a benchmark's name, result, and units over the UART
+void report_benchmark(char name[], uint64 value, char units[]);
+
+// Runs each benchmark, reporting the results over the UART (only built with make bench)
+void run_benchmarks();
+
+#endif
@@ -0,0 +1,206 @@
+#import "types.h"
+#import "convert.h"
+#import "swar.h"
+
+// The readers work 8 characters at a time using the helpers in swar.h
+
+// Every two digit number, so the writers can do two digits per divide. Dividing by a constant compiles
+// to a multiply by its reciprocal, so there's no real divide either.
+
+static const char two_digits[200] =
+    "00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859" "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+static const uint64 powers_of_ten[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+// Local functions
+
+static uint64 decimal_bytes(uint64 eight) {
+    // High bit set in each byte that's '0' to '9'
+
+    return bytes_at_least(eight, '0') & ~bytes_at_least(eight, '9' + 1) & ~eight & HIGH_BITS;
+}
+
+static uint64 hex_letter_bytes(uint64 eight) {
+    // High bit set in each byte that's 'a' to 'f' or 'A' to 'F'
+
+    uint64 lower = eight | EVERY_BYTE(0x20);
+
+    return bytes_at_least(lower, 'a') & ~bytes_at_least(lower, 'f' + 1) & ~eight & HIGH_BITS;
+}
+
+// Functions
+
+uint8 decimal_length(uint64 number) {
+    // Compare against powers of ten rather than divide, a 64 bit number has at most 20 digits
+
+    uint8 digits = 1;
+
+    for (uint64 power = 10; digits < 20 && number >= power; power *= 10)
+        digits++;
+
+    return digits;
+}
+
+uint8 *write_decimal(uint8 *out, uint64 number) {
+    // We know how long it is, so fill it in from the right two digits at a time
+
+    uint8 digits = decimal_length(number);
+    uint8 *position = out + digits;
+
+    while (number >= 100) {
+        uint64 pair = number % 100;
+
+        number = number / 100;
+        position -= 2;
+        position[0] = two_digits[pair * 2];
+        position[1] = two_digits[pair * 2 + 1];
+    }
+
+    if (number >= 10) {
+        position[-2] = two_digits[number * 2];
+        position[-1] = two_digits[number * 2 + 1];
+    } else {
+        position[-1] = '0' + number;
+    }
+
+    return out + digits;
+}
+
+uint8 *write_hex(uint8 *out, uint64 number, uint8 bytes) {
+    // Each nibble is a table lookup, no compares
+
+    for (int8 nibble = bytes * 2 - 1; nibble >= 0; nibble--)
+        *out++ = hex_digits[(number >> (nibble * 4)) & 0xF];
+
+    return out;
+}
+
+uint8 *write_binary(uint8 *out, uint64 number, uint8 bytes) {
+    // Copy each byte into all eight bytes and keep one bit in each: bit 7 in the low byte (which is
+    // stored first) down to bit 0 in the high byte. Adding 0x7F turns any set bit into the high bit
+    // without carrying, then we move that to the bottom, add '0' to all eight, and store them together.
+
+    for (int8 b = bytes - 1; b >= 0; b--) {
+        uint64 byte = (number >> (b * 8)) & 0xFF;
+        uint64 bits = (byte * EVERY_BYTE(1)) & 0x0102040810204080ULL;
+        uint64 characters = (((bits + EVERY_BYTE(0x7F)) & HIGH_BITS) >> 7) + EVERY_BYTE('0');
+
+        store_eight(out, characters);
+
+        out += 8;
+    }
+
+    return out;
+}
+
+uint64 read_decimal(uint8 *text, uint16 length, uint16 *used) {
+    uint64 number = 0;
+    uint16 index = 0;
+
+    // Up to eight digits at a time while we can load eight characters. If only the first few are digits
+    // we shift them up to the top, the empty bytes below act as leading zeros. Then the digit bytes are
+    // folded together in pairs, then fours, then all eight.
+
+    while (index + 8 <= length) {
+        uint64 eight = load_eight(&text[index]);
+        uint64 not_digits = ~decimal_bytes(eight) & HIGH_BITS;
+        uint8 digits = not_digits == 0 ? 8 : __builtin_ctzll(not_digits) / 8;
+
+        if (digits == 0)
+            break;
+
+        eight = (eight & EVERY_BYTE(0x0F)) << (8 * (8 - digits));
+        eight = (eight * (1 + (10 << 8))) >> 8;
+        eight = ((eight & 0x00FF00FF00FF00FFULL) * (1 + (100 << 16))) >> 16;
+        eight = ((eight & 0x0000FFFF0000FFFFULL) * (1 + (10000ULL << 32))) >> 32;
+
+        number = number * powers_of_ten[digits] + eight;
+        index += digits;
+
+        if (digits < 8)
+            break;
+    }
+
+    // Then one at a time
+
+    while (index < length && text[index] >= '0' && text[index] <= '9')
+        number = number * 10 + (text[index++] - '0');
+
+    *used = index;
+
+    return number;
+}
+
+uint64 read_hex(uint8 *text, uint16 length, uint16 *used) {
+    uint64 number = 0;
+    uint16 index = 0;
+
+    // Eight hex digits at a time while we have them. Letters are 1 to 6 in the low nibble, so add 9.
+    // Then fold the nibbles into bytes, the bytes into pairs, and the pairs into 32 bits.
+
+    while (index + 8 <= length) {
+        uint64 eight = load_eight(&text[index]);
+        uint64 letters = hex_letter_bytes(eight);
+
+        if ((decimal_bytes(eight) | letters) != HIGH_BITS)
+            break;
+
+        eight = (eight & EVERY_BYTE(0x0F)) + (letters >> 7) * 9;
+        eight = ((eight & 0x000F000F000F000FULL) << 4) | ((eight >> 8) & 0x000F000F000F000FULL);
+        eight = ((eight & 0x000000FF000000FFULL) << 8) | ((eight >> 16) & 0x000000FF000000FFULL);
+        eight = ((eight & 0x000000000000FFFFULL) << 16) | ((eight >> 32) & 0x000000000000FFFFULL);
+
+        number = (number << 32) | eight;
+        index += 8;
+    }
+
+    // Then one at a time
+
+    while (index < length) {
+        uint8 c = text[index];
+
+        if (c >= '0' && c <= '9')
+            number = (number << 4) | (c - '0');
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            number = (number << 4) | ((c | 0x20) - 'a' + 10);
+        else
+            break;
+
+        index++;
+    }
+
+    *used = index;
+
+    return number;
+}
+
+uint64 read_binary(uint8 *text, uint16 length, uint16 *used) {
+    uint64 number = 0;
+    uint16 index = 0;
+
+    // Eight bits at a time while we have them. Gather the low bit of each byte into the top byte with a
+    // multiply, the first character (low byte) ends up as the most significant bit.
+
+    while (index + 8 <= length) {
+        uint64 eight = load_eight(&text[index]);
+
+        if ((eight & ~EVERY_BYTE(0x01)) != EVERY_BYTE('0'))
+            break;
+
+        number = (number << 8) | (((eight & EVERY_BYTE(0x01)) * 0x8040201008040201ULL) >> 56);
+        index += 8;
+    }
+
+    // Then one at a time
+
+    while (index < length && (text[index] == '0' || text[index] == '1'))
+        number = (number << 1) | (text[index++] - '0');
+
+    *used = index;
+
+    return number;
+}
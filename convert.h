@@ -0,0 +1,31 @@
+#include "types.h"
+
+#ifndef __convert_h__
+#define	__convert_h__
+
+// Number <-> text conversion kernels for the string code. Writers need room for what they write and
+// return where the next byte goes. Readers stop at the first character that isn't a digit of their base
+// and report how many characters they used, checking what that character was is up to the caller.
+
+// How many decimal digits the number needs, 1 to 20
+uint8 decimal_length(uint64 number);
+
+// Writes the number in decimal, decimal_length() bytes
+uint8 *write_decimal(uint8 *out, uint64 number);
+
+// Writes the low bytes of the number in hex, two characters per byte, most significant first (no 0x)
+uint8 *write_hex(uint8 *out, uint64 number, uint8 bytes);
+
+// Writes the low bytes of the number in binary, eight characters per byte, most significant first (no 0b)
+uint8 *write_binary(uint8 *out, uint64 number, uint8 bytes);
+
+// Reads a decimal number from up to length characters, setting used to how many were digits
+uint64 read_decimal(uint8 *text, uint16 length, uint16 *used);
+
+// Reads a hex number (either case) from up to length characters, setting used to how many were digits
+uint64 read_hex(uint8 *text, uint16 length, uint16 *used);
+
+// Reads a binary number from up to length characters, setting used to how many were digits
+uint64 read_binary(uint8 *text, uint16 length, uint16 *used);
+
+#endif
@@ -0,0 +1,159 @@
+#import "types.h"
+#import "smp.h"
+#import "irq.h"
+#import "timer.h"
+#import "uart.h"
+#import "string.h"
+#import "idle.h"
+
+#define WAKE_MAILBOX                    0                           // The local mailbox waking another core uses
+
+// Each core only writes its own times, other cores just read them
+typedef struct __attribute__((aligned(CACHE_LINE_BYTES))) {
+    uint64 started;                     // When init_idle() ran, 0 if it hasn't
+    uint64 idle_ticks;                  // Every finished sleep added up
+    volatile uint64 idle_since;         // When the sleep we're in started, 0 when awake
+} idle_data;
+
+static idle_data idle_times[CORE_COUNT];
+static volatile uint64 idle_cores;                                  // Bit n is set while core n is in idle_core()
+
+// Local functions
+
+static void woken(void *unused) {
+    // Only stop the mailbox asking, looking at the run queue happens at the end of every IRQ anyway
+
+    clear_mailbox(WAKE_MAILBOX);
+}
+
+static idle_data *start_sleep() {
+    idle_data *data = &idle_times[this_core()->core];
+
+    data->idle_since = read_timer();
+
+    return data;
+}
+
+static void end_sleep(idle_data *data) {
+    data->idle_ticks += read_timer() - data->idle_since;
+    data->idle_since = 0;
+}
+
+// Functions
+
+void init_idle() {
+    idle_data *data = &idle_times[this_core()->core];
+
+    data->idle_ticks = 0;
+    data->idle_since = 0;
+    data->started = read_timer();
+
+    register_irq_handler(IRQ_LOCAL_MAILBOX_0 + WAKE_MAILBOX, woken, null);
+    enable_irq_line(IRQ_LOCAL_MAILBOX_0 + WAKE_MAILBOX);
+}
+
+void wait_for_interrupt() {
+    idle_data *data = start_sleep();
+
+    asm volatile ("dsb sy\n\twfi" : : : "memory");                  // Let our stores finish before we stop
+
+    end_sleep(data);
+}
+
+void wait_for_event() {
+    idle_data *data = start_sleep();
+
+    asm volatile ("wfe" : : : "memory");
+
+    end_sleep(data);
+}
+
+void idle_core(bool (*work_waiting)()) {
+    // The barrier at the end of atomic_set_bits() means anyone who queues a thread after work_waiting() has
+    // looked also sees our bit and wakes us, wake_idle_core() has the barrier for the other side
+
+    uint64 bit = 1ULL << this_core()->core;
+
+    atomic_set_bits(&idle_cores, bit);
+
+    if (!work_waiting())
+        wait_for_interrupt();
+
+    atomic_clear_bits(&idle_cores, bit);
+}
+
+bool wake_idle_core(uint8 cores) {
+    // Whoever clears a core's bit is the one that wakes it, so two cores queueing threads at once wake two
+    // different cores rather than both picking the same one
+
+    asm volatile ("dmb ish" : : : "memory");                        // What we queued is visible before we look
+
+    while (true) {
+        uint64 candidates = idle_cores & cores;
+
+        if (candidates == 0)
+            return false;
+
+        uint64 bit = candidates & -candidates;
+
+        if (atomic_clear_bits(&idle_cores, bit) & bit) {
+            wake_core(__builtin_ctzll(bit));
+
+            return true;
+        }
+    }
+}
+
+void wake_core(uint8 core) {
+    signal_mailbox(core, WAKE_MAILBOX);
+}
+
+void halt() {
+    // Nothing will set the timer again, so only the event stream wakes us (and sends us straight back)
+
+    uart_flush();
+
+    disable_interrupts();
+    stop_timer();
+
+    while (true)
+        wait_for_event();
+}
+
+core_times read_core_times(uint8 core) {
+    core_times times = {0, 0};
+
+    if (core >= CORE_COUNT || idle_times[core].started == 0)
+        return times;
+
+    idle_data *data = &idle_times[core];
+    uint64 now = read_timer();
+    uint64 since = data->idle_since;
+
+    times.idle_ticks = data->idle_ticks;
+
+    if (since != 0 && since < now)
+        times.idle_ticks += now - since;
+
+    uint64 total = now - data->started;
+
+    times.busy_ticks = total > times.idle_ticks ? total - times.idle_ticks : 0;
+
+    return times;
+}
+
+void report_core_times() {
+    uint64 ticks_per_millisecond = timer_frequency() / 1000;
+
+    for (uint8 core = 0; core < CORE_COUNT; core++) {
+        core_times times = read_core_times(core);
+        uint64 total = times.idle_ticks + times.busy_ticks;
+
+        if (total == 0)
+            continue;
+
+        uart_printf(LITERAL("Core %u: %u ms idle, %u ms busy, %u%% idle\n"), core,
+                    times.idle_ticks / ticks_per_millisecond, times.busy_ticks / ticks_per_millisecond,
+                    times.idle_ticks * 100 / total);
+    }
+}
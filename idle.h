@@ -0,0 +1,49 @@
+#include "types.h"
+
+#ifndef __idle_h__
+#define	__idle_h__
+
+// Cores with nothing to do sleep instead of spinning. A core with nothing to run sleeps in WFI until an IRQ
+// comes in, which is its timer (set for the next thread that needs waking, see thread.c), a device, or
+// another core waking it with wake_idle_core() because it queued a thread. Anything waiting on a status
+// register nothing interrupts for sleeps in WFE, which the generic timer's event stream (turned on in boot.S)
+// ends every 1024 counter ticks, about 50us on the Pi.
+
+// How long a core has spent sleeping and working since init_idle(), in timer ticks
+typedef struct {
+    uint64 idle_ticks;
+    uint64 busy_ticks;
+} core_times;
+
+// Starts this core's idle and busy times and lets other cores wake it, call on each core once its IRQs
+// are set up
+void init_idle();
+
+// Sleeps this core until an IRQ is pending, even one masked here. Mask IRQs, check there's nothing to do,
+// then call it, so an IRQ that comes in between still ends the sleep. The time counts as idle.
+void wait_for_interrupt();
+
+// Sleeps this core until the next event, from SEV, a store to a location it has an exclusive load from, or
+// the event stream. Nothing guarantees there was a reason, so check again after. The time counts as idle.
+void wait_for_event();
+
+// Marks this core idle and sleeps until an IRQ, unless work_waiting() says there's something to do. Call it
+// with IRQs masked, they stay masked on the way out so the one that woke us runs once they're restored.
+void idle_core(bool (*work_waiting)());
+
+// Wakes one of the cores in the bitmask that's in idle_core(), returns false if none of them are
+bool wake_idle_core(uint8 cores);
+
+// Interrupts the core so it looks at its run queue again, whether it's idle or not
+void wake_core(uint8 core);
+
+// Sends everything queued for the UART then stops this core for good, for panics
+__attribute__((__noreturn__)) void halt();
+
+// A core's idle and busy times, counting any sleep it's in right now
+core_times read_core_times(uint8 core);
+
+// Sends a line over the UART with each core's idle and busy times
+void report_core_times();
+
+#endif
@@ -0,0 +1,203 @@
+#import "types.h"
+#import "irq.h"
+#import "smp.h"
+#import "string.h"
+#import "benchmark.h"
+#import "thread.h"
+
+// An IRQ can come from two places. The BCM2837 interrupt controller (the GPU's) has lines 0 - 63 for the
+// peripherals and sends them all to one core, the main core unless told otherwise. Each core also has its own
+// sources on the local interrupt controller (timers, mailboxes and so on), and one of those is "the GPU's
+// controller has something". handle_irq() looks at this core's local sources first, since that's one read,
+// and only reads the GPU's pending registers if they say so.
+
+// The BCM2837 interrupt controller, lines 0 - 31 are in the 1 registers and 32 - 63 in the 2 registers
+#define IRQ_PENDING_1                   ((volatile uint32 *) 0x3F00B204)
+#define IRQ_PENDING_2                   ((volatile uint32 *) 0x3F00B208)
+#define IRQ_ENABLE_1                    ((volatile uint32 *) 0x3F00B210)
+#define IRQ_DISABLE_1                   ((volatile uint32 *) 0x3F00B21C)
+
+// The local interrupt controller, the last three have one register per core
+#define LOCAL_GPU_ROUTING               ((volatile uint32 *) 0x4000000C)
+#define LOCAL_TIMER_CONTROL             ((volatile uint32 *) 0x40000040)
+#define LOCAL_MAILBOX_CONTROL           ((volatile uint32 *) 0x40000050)
+#define LOCAL_IRQ_SOURCE                ((volatile uint32 *) 0x40000060)
+
+// Each core has four mailboxes, writing bits to one's set register raises its IRQ on that core until they're
+// written back to its clear register. A core's four are one word apart, the next core's 16 bytes on.
+#define LOCAL_MAILBOX_SET               ((volatile uint32 *) 0x40000080)
+#define LOCAL_MAILBOX_CLEAR             ((volatile uint32 *) 0x400000C0)
+#define LOCAL_MAILBOXES                 4
+
+#define LOCAL_SOURCE_GPU                (1 << (IRQ_LOCAL_GPU - IRQ_LOCAL))
+#define LOCAL_SOURCE_ALL                0xFFF
+
+typedef struct {
+    irq_handler handler;
+    void *data;
+} registered_handler;
+
+// Each core only writes its own statistics, so they need no locks, and each core's are on their own lines
+typedef struct __attribute__((aligned(CACHE_LINE_BYTES))) {
+    irq_statistics lines[IRQ_COUNT];
+} core_irq_statistics;
+
+static registered_handler handlers[IRQ_COUNT];
+static core_irq_statistics statistics[CORE_COUNT];
+static volatile uint64 enabled_lines;                               // Which of the GPU's lines are enabled
+
+// Local functions
+
+static void dispatch(uint8 line, irq_statistics *line_statistics, uint64 entry_cycles) {
+    uint64 cycles = read_cycle_counter() - entry_cycles;
+
+    line_statistics->count++;
+    line_statistics->total_cycles += cycles;
+
+    if (cycles > line_statistics->most_cycles)
+        line_statistics->most_cycles = cycles;
+
+    registered_handler *registered = &handlers[line];
+
+    if (registered->handler != null)
+        registered->handler(registered->data);
+    else
+        disable_irq_line(line);                                     // Or it would fire again as soon as we return
+}
+
+// Functions
+
+void init_irq() {
+    // Everything from the GPU's controller goes to the main core, where the UART's handler expects it
+
+    *LOCAL_GPU_ROUTING = 0;
+
+    init_cycle_counter();
+}
+
+void register_irq_handler(uint8 line, irq_handler handler, void *data) {
+    if (line >= IRQ_COUNT)
+        return;
+
+    handlers[line].data = data;
+    handlers[line].handler = handler;
+}
+
+void enable_irq_line(uint8 line) {
+    uint8 core = this_core()->core;
+
+    if (line < IRQ_LOCAL) {
+        // Writing a 1 enables that line, 0s leave the others alone
+
+        atomic_set_bits(&enabled_lines, 1ULL << line);
+
+        IRQ_ENABLE_1[line / 32] = 1 << (line % 32);
+    } else if (line < IRQ_LOCAL_MAILBOX_0) {
+        // Only this core changes its own control registers, so there's no need for a lock
+
+        LOCAL_TIMER_CONTROL[core] |= 1 << (line - IRQ_LOCAL);
+    } else if (line < IRQ_LOCAL_GPU) {
+        LOCAL_MAILBOX_CONTROL[core] |= 1 << (line - IRQ_LOCAL_MAILBOX_0);
+    }
+}
+
+void disable_irq_line(uint8 line) {
+    uint8 core = this_core()->core;
+
+    if (line < IRQ_LOCAL) {
+        IRQ_DISABLE_1[line / 32] = 1 << (line % 32);
+
+        atomic_clear_bits(&enabled_lines, 1ULL << line);
+    } else if (line < IRQ_LOCAL_MAILBOX_0) {
+        LOCAL_TIMER_CONTROL[core] &= ~(1 << (line - IRQ_LOCAL));
+    } else if (line < IRQ_LOCAL_GPU) {
+        LOCAL_MAILBOX_CONTROL[core] &= ~(1 << (line - IRQ_LOCAL_MAILBOX_0));
+    }
+}
+
+void signal_mailbox(uint8 core, uint8 mailbox) {
+    asm volatile ("dsb sy" : : : "memory");                         // Our stores are visible before it looks
+
+    LOCAL_MAILBOX_SET[core * LOCAL_MAILBOXES + mailbox] = 1;
+}
+
+void clear_mailbox(uint8 mailbox) {
+    LOCAL_MAILBOX_CLEAR[this_core()->core * LOCAL_MAILBOXES + mailbox] = 0xFFFFFFFF;
+}
+
+irq_statistics read_irq_statistics(uint8 line) {
+    irq_statistics total = {0, 0, 0};
+
+    if (line >= IRQ_COUNT)
+        return total;
+
+    for (uint8 core = 0; core < CORE_COUNT; core++) {
+        irq_statistics *core_statistics = &statistics[core].lines[line];
+
+        total.count += core_statistics->count;
+        total.total_cycles += core_statistics->total_cycles;
+
+        if (core_statistics->most_cycles > total.most_cycles)
+            total.most_cycles = core_statistics->most_cycles;
+    }
+
+    return total;
+}
+
+void report_irq_statistics() {
+    for (uint8 line = 0; line < IRQ_COUNT; line++) {
+        irq_statistics total = read_irq_statistics(line);
+
+        if (total.count > 0)
+            uart_printf(LITERAL("IRQ %u: %u times, %u cycles to the handler on average, %u at most\n"), line,
+                        total.count, total.total_cycles / total.count, total.most_cycles);
+    }
+}
+
+void handle_irq(uint64 entry_cycles) {
+    irq_statistics *core_statistics = statistics[this_core()->core].lines;
+    uint32 sources = LOCAL_IRQ_SOURCE[this_core()->core] & LOCAL_SOURCE_ALL;
+
+    // This core's own sources, lowest first
+
+    for (uint32 local = sources & ~LOCAL_SOURCE_GPU; local != 0; local &= local - 1) {
+        uint8 line = IRQ_LOCAL + __builtin_ctz(local);
+
+        dispatch(line, &core_statistics[line], entry_cycles);
+    }
+
+    // Then the GPU's, only counting the ones we enabled
+
+    if (sources & LOCAL_SOURCE_GPU) {
+        uint64 pending = (*IRQ_PENDING_1 | (uint64) *IRQ_PENDING_2 << 32) & enabled_lines;
+
+        for (; pending != 0; pending &= pending - 1) {
+            uint8 line = __builtin_ctzll(pending);
+
+            dispatch(line, &core_statistics[line], entry_cycles);
+        }
+    }
+
+    // Last of all, since we may not come back here for a while
+
+    preempt_if_needed();
+}
+
+void report_exception(uint64 entry) {
+    // Entries go in groups of four (synchronous, IRQ, FIQ, SError) for each place the exception came from.
+    // uart_printf() needs no heap and sends everything itself with IRQs masked, so it works from here.
+
+    string *kinds[] = {LITERAL("Synchronous"), LITERAL("IRQ"), LITERAL("FIQ"), LITERAL("SError")};
+    string *origins[] = {LITERAL("EL1 on SP_EL0"), LITERAL("EL1"), LITERAL("EL0 in AArch64"),
+                         LITERAL("EL0 in AArch32")};
+    uint64 syndrome, address, fault_address, state;
+
+    asm volatile ("mrs %0, esr_el1" : "=r" (syndrome));
+    asm volatile ("mrs %0, elr_el1" : "=r" (address));
+    asm volatile ("mrs %0, far_el1" : "=r" (fault_address));
+    asm volatile ("mrs %0, spsr_el1" : "=r" (state));
+
+    uart_printf(LITERAL("\n%s exception from %s on core %u: ESR %x, ELR %x, FAR %x, SPSR %x\n"),
+                kinds[entry % 4], origins[(entry / 4) % 4], this_core()->core, syndrome, address,
+                fault_address, state);
+}
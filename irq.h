@@ -0,0 +1,100 @@
+#include "types.h"
+
+#ifndef __irq_h__
+#define	__irq_h__
+
+// IRQ lines are numbered the way the datasheets do. 0 - 63 are on the BCM2837 interrupt controller (the GPU's),
+// which sends them all to the main core. 64 and up are each core's own, on the local interrupt controller.
+#define IRQ_AUX                         29                          // The mini UART (and the unused SPIs)
+#define IRQ_PL011                       57                          // The PL011 UART
+
+#define IRQ_LOCAL                       64                          // The first of the per core lines
+#define IRQ_LOCAL_SECURE_TIMER          64                          // CNTPS
+#define IRQ_LOCAL_PHYSICAL_TIMER        65                          // CNTP, the one EL1 uses
+#define IRQ_LOCAL_HYPERVISOR_TIMER      66                          // CNTHP
+#define IRQ_LOCAL_VIRTUAL_TIMER         67                          // CNTV
+#define IRQ_LOCAL_MAILBOX_0             68                          // Through 71 for mailboxes 1 - 3
+#define IRQ_LOCAL_GPU                   72                          // Never dispatched, it means look at 0 - 63
+#define IRQ_LOCAL_PMU                   73
+#define IRQ_LOCAL_AXI                   74
+#define IRQ_LOCAL_TIMER                 75                          // The local timer (not the generic timer)
+
+#define IRQ_COUNT                       76
+
+// Called for the line's IRQ with the data it was registered with, IRQs are masked while it runs. It has to
+// make its device stop asking (by reading data, clearing a flag and so on) before it returns.
+typedef void (*irq_handler)(void *data);
+
+// How often a line has fired and how long (in cycles) it took from the vector table to its handler
+typedef struct {
+    uint64 count;
+    uint64 total_cycles;
+    uint64 most_cycles;
+} irq_statistics;
+
+// Sets up the interrupt controllers and the cycle counter the statistics use, call once on the main core
+void init_irq();
+
+// Has the handler called whenever the line fires. Register it before enabling the line, a line that fires
+// with no handler is turned off.
+void register_irq_handler(uint8 line, irq_handler handler, void *data);
+
+// Lets the line through. Lines 0 - 63 go to the main core, the local timer and mailbox lines (64 - 71) are
+// enabled for the core calling this.
+void enable_irq_line(uint8 line);
+
+// Stops the line, on this core for the local ones
+void disable_irq_line(uint8 line);
+
+// Raises IRQ_LOCAL_MAILBOX_0 + mailbox on the core, it keeps coming until that core calls clear_mailbox()
+void signal_mailbox(uint8 core, uint8 mailbox);
+
+// Stops one of this core's mailboxes raising its IRQ, for its handler
+void clear_mailbox(uint8 mailbox);
+
+// Adds up a line's statistics over every core
+irq_statistics read_irq_statistics(uint8 line);
+
+// Sends a line over the UART for each IRQ line that has fired
+void report_irq_statistics();
+
+// Unmasks IRQs on this core, the vector table from vectors.S must already be in place (boot.S does that)
+static inline void enable_interrupts() {
+    asm volatile ("msr daifclr, #2" : : : "memory");
+}
+
+// Masks IRQs on this core
+static inline void disable_interrupts() {
+    asm volatile ("msr daifset, #2" : : : "memory");
+}
+
+// Masks IRQs on this core, returning how they were for restore_interrupts()
+static inline uint64 save_and_disable_interrupts() {
+    uint64 daif;
+
+    asm volatile ("mrs %0, daif\n\tmsr daifset, #2" : "=r" (daif) : : "memory");
+
+    return daif;
+}
+
+// Puts IRQs back how save_and_disable_interrupts() found them
+static inline void restore_interrupts(uint64 daif) {
+    asm volatile ("msr daif, %0" : : "r" (daif) : "memory");
+}
+
+// True if IRQs can reach this core right now
+static inline bool interrupts_enabled() {
+    uint64 daif;
+
+    asm volatile ("mrs %0, daif" : "=r" (daif));
+
+    return (daif & (1 << 7)) == 0;
+}
+
+// Called from the vector table for every IRQ, with the cycle counter as it was on the way in
+void handle_irq(uint64 entry_cycles);
+
+// Called from the vector table for any other exception, says what happened over the UART
+void report_exception(uint64 entry);
+
+#endif
@@ -16,9 +16,11 @@
 #define MAILBOX_RESPONSE								0x80000000
 #define MAILBOX_REQUEST									0
 #define MAILBOX_TAG_GET_SERIAL							0x10004
+#define MAILBOX_TAG_GET_ARM_MEMORY						0x10005
 #define MAILBOX_TAG_LAST								0
 
 // Permanently reserved storage for communicating with the GPU aligned on the right boundary
+// mailbox_call() takes care of the cache maintenance, see mailbox.S for the rules
 extern uint32 mailbox_data[36];
 
 // Makes a call to the given channel with the data in mailbox_data, returns true for success
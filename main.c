@@ -2,18 +2,33 @@
 #import "mailbox.h"
 #import "memory.h"
 #import "string.h"
+#import "benchmark.h"
+#import "smp.h"
+#import "irq.h"
+#import "thread.h"
+
+#define CORE_START_SPINS    1000000
+
+static void check_in(void *checked_in) {
+    ((bool *) checked_in)[this_core()->core] = true;
+}
 
 void main() {
+    init_smp();
+    init_irq();
+
 	uart_init();
 
+    enable_interrupts();
+
     uart_send_char('\n');
 
 	init_memory_pools();
 
     uart_send_char('|');
 
-    string *one = string_from_cstring("abc132 %c%% %d, %d, %D, %D, >%s< abc123\n%x %x %x %x.\n%b %b\n%b %b.");
-    string *two = string_from_cstring("<- this is fun and long enough to force an allocation ->");
+    string *one = LITERAL("abc132 %c%% %d, %d, %D, %D, >%s< abc123\n%x %x %x %x.\n%b %b\n%b %b.");
+    string *two = LITERAL("<- this is fun and long enough to force an allocation ->");
     string *three = format_string(one, 'r', 4, -4, 8589934592, -8589934592, two,
                                     0x12, 0x3456, 0x789ABCDE, 0x0123456789ABCDEF,
                                     0xAA, 0x5555, 0xFFAA55FF, 0x0055AA0096969696);
@@ -23,6 +38,43 @@ void main() {
     uart_send_char('|');
     uart_send_char('\n');
 
+    // Wake the other cores and have each one check in using its own core data
+
+    bool checked_in[CORE_COUNT] = {true};
+    uint64 cores_up = 0;
+
+    for (uint8 core = 1; core < CORE_COUNT; core++)
+        start_core(core, check_in, checked_in);
+
+    for (uint32 spins = 0; spins < CORE_START_SPINS; spins++) {
+        bool waiting = false;
+
+        for (uint8 core = 1; core < CORE_COUNT; core++)
+            waiting |= core_busy(core);
+
+        if (!waiting)
+            break;
+    }
+
+    for (uint8 core = 0; core < CORE_COUNT; core++)
+        cores_up += checked_in[core];
+
+    uart_printf(LITERAL("%u cores up\n"), cores_up);
+
+    // From here on we're a thread, and every core runs threads. Without the MMU the locks do nothing, so
+    // only the main core can.
+
+    init_threads();
+
+#ifndef NO_MMU
+    for (uint8 core = 1; core < CORE_COUNT; core++)
+        start_core(core, start_threads, null);
+#endif
+
+#ifdef BENCHMARKS
+    run_benchmarks();
+#endif
+
 //	string *str = string_from_cstring("Hello!\n");
 //
 //	uart_send_string(str);
@@ -91,5 +143,7 @@ void main() {
 //        uart_send_char('\n');
 //    }
 
-    while (true) {};
+    // Nothing else to do, the idle threads get memory ready for later
+
+    exit_thread();
 }
@@ -1,303 +1,795 @@
 #import "types.h"
 #import "uart.h"
+#import "mailbox.h"
 #import "memory.h"
+#import "smp.h"
+#import "irq.h"
+#import "idle.h"
 
-// QEMU gives us a total of 0x3c000000 bytes of memory (3 gigs) starting at 0x00000000
+// QEMU gives us a total of 0x3c000000 bytes of memory (960 megs) starting at 0x00000000, a real Pi
+// gives the ARM whatever the GPU doesn't keep. We ask the GPU at boot and use everything it says is ours.
 // The next address after the stack is _end, so that's where it's safe to start allocating memory
-// We'll also start alignment at a nice even address. I'll pick the 1MB boundary at 0x100000
+// We'll also start alignment at a nice even address. I'll pick the 1MB boundary at 0x100000 at the lowest.
 
 #define SAFE_MEMORY_START           ((void *) 0x00100000)           // The 1MB mark
+#define MEMORY_ALIGNMENT            0x00100000                      // Where we start is rounded up to this
+#define FALLBACK_MEMORY_END         ((void *) 0x10000000)           // 256MB, if the GPU won't tell us
+
+extern uint8 _end[];                                                // From link.ld
 
 // We'll use bitmaps to keep track of allocated blocks for quick searches. A set bit indicates it's in use.
+//
+// Every size class we allocate from, smallest first, as CLASS(block bytes, percent of memory).
+// Each block size must be a power of two. Each class gets its own bitmap, index, and pool of blocks,
+// laid out one after the other starting after the kernel. This is the only list to edit.
+//
+// Whatever the classes don't use goes to the page allocator below for anything bigger than 16k.
+
+#define SIZE_CLASSES(CLASS)                                                                 \
+    CLASS(64,       1)                                                                      \
+    CLASS(128,      2)                                                                      \
+    CLASS(256,      2)                                                                      \
+    CLASS(512,      3)                                                                      \
+    CLASS(1024,     5)                                                                      \
+    CLASS(2048,     5)                                                                      \
+    CLASS(4096,     7)                                                                      \
+    CLASS(8192,     10)                                                                     \
+    CLASS(16384,    15)
+
+#define COUNT_CLASS(bytes, percent) + 1
+#define SIZE_CLASS_COUNT            (0 SIZE_CLASSES(COUNT_CLASS))
+
+// Each pool keeps a two level index on top of its bitmap so finding a free block never needs a scan.
+// A set bit in the summary means that double word of the bitmap has at least one free block, and
+// a set bit in the top double word means that double word of the summary has at least one set bit.
+// One top double word covers 64 * 64 * 64 = 262,144 blocks, so three CLZ/CLS ops always find a block.
+//
+// The cores claim and release blocks without a lock. The bitmap is the truth and is only changed with
+// atomic operations, the index bits are hints. A hint is only cleared after its double word looked full,
+// and the double word is checked again afterwards, so a block freed at the same time is never hidden.
+
+#define MAXIMUM_POOL_BLOCKS         (DOUBLE_WORD_BITS * DOUBLE_WORD_BITS * DOUBLE_WORD_BITS)
+
+// Zeroing a block costs as much as the block is big, so when the kernel is idle it claims a few blocks
+// of each class and zeroes them ahead of time. allocate() hands those out first so it doesn't have to.
+
+#define ZEROED_BLOCKS_PER_CLASS     8
+
+// Each core keeps a magazine of free blocks for every class so most allocations and frees never touch the
+// shared bitmaps. An empty magazine is refilled with a batch from the pool, a full one
+// gives its oldest batch back. Blocks sitting in magazines are marked used in the pool's bitmap.
+
+#define MAGAZINE_BLOCKS             16
+#define MAGAZINE_BATCH              8
+
+typedef struct {
+    volatile uint64 *bitmap;        // A set bit indicates the block is in use
+    volatile uint64 *summary;       // A set bit indicates that bitmap double word has a free block
+    volatile uint64 top;            // A set bit indicates that summary double word has a set bit, 0 means full
+    void *start;                    // Where the blocks in the pool start
+    void *end;                      // The first address past the last block
+    uint32 blocks;                  // How many blocks the pool holds
+    uint16 block_size;              // How big each block is
+    uint8 block_shift;              // log2 of block_size, to turn offsets into block numbers
+    uint8 percent;                  // How much of memory the pool gets
+    uint8 zeroed_count;             // How many blocks are waiting in zeroed
+    void *zeroed[ZEROED_BLOCKS_PER_CLASS];  // Blocks already claimed and zeroed, ready to hand out
+    spinlock lock;                  // Held while touching the zeroed blocks
+} memory_pool;
+
+typedef struct __attribute__((aligned(CACHE_LINE_BYTES))) {
+    uint8 count;                    // How many blocks are in the magazine
+    void *blocks[MAGAZINE_BLOCKS];  // Free blocks, the most recently freed (warmest) last
+} magazine;
+
+// The pools themselves. The sizes are filled in here, how many blocks and where they live is filled
+// in by init_memory_pools() once we know how much memory there is
+
+#define POOL_ENTRY(bytes, share)    { .block_size = bytes, .block_shift = __builtin_ctz(bytes), .percent = share },
+
+static memory_pool pools[SIZE_CLASS_COUNT] = { SIZE_CLASSES(POOL_ENTRY) };
+
+#define LARGEST_CLASS_BYTES         (pools[SIZE_CLASS_COUNT - 1].block_size)
+
+// Every core's magazines, only ever touched by that core
+
+static magazine magazines[CORE_COUNT][SIZE_CLASS_COUNT];
+
+// Anything bigger than the largest class comes from a buddy allocator of 4k pages. Blocks are a power of
+// two pages (an "order") from 4k up to 64 megs. Free blocks of each order sit on a doubly linked list
+// kept inside the free pages themselves, so splitting and coalescing are O(log n).
+//
+// We keep one byte per page saying what's there. The first page of a block holds its order, with
+// PAGE_FREE set if the block is free. Every other page holds PAGE_NOT_HEAD.
+
+#define PAGE_SIZE                   4096
+#define PAGE_SHIFT                  12
+#define MAXIMUM_PAGE_ORDER          14                              // 2^14 pages = 64 megs
+
+#define PAGE_FREE                   0x80
+#define PAGE_NOT_HEAD               0xFF
+
+typedef struct free_page_block {
+    struct free_page_block *next;
+    struct free_page_block *previous;
+} free_page_block;
+
+static free_page_block *free_page_lists[MAXIMUM_PAGE_ORDER + 1];   // Free blocks of each order
+
+static uint8 *page_orders;          // One byte per page, as above
+static void *pages_start;           // Where the pages start
+static void *pages_end;             // The first address past the last page
+static uint64 page_count;           // How many pages there are
+static spinlock page_lock;          // Held while touching any of the above
+
+uint64 allocation_count;            // How many allocations have been made (make bench only), not atomic so only roughly right with more cores
 
-#define BITMAP_BYTES                128                             // 0x0400 bytes
-#define BITMAP_DOUBLE_WORDS         (BITMAP_BYTES / 8)              // 0x0400 bytes
-#define BITS_PER_BYTE               8
-#define BITMAP_TOTAL_SIZE           (BITMAP_BYTES * BITS_PER_BYTE)  // 1024 records max
+// Local functions
 
-// We'll let our OS allocate things in three sizes: 64 bytes, 1024 bytes, and 16k bytes
+static __attribute__((__noreturn__)) void panic_out_of_memory(uint64 size) {
+    // uart_printf() and LITERAL() don't allocate, so this is safe with no memory left
 
-#define SMALL_SIZE_BYTES            MINIMUM_ALLOCATION_BYTES
-#define SMALL_SIZE_TOTAL            (SMALL_SIZE_BYTES * BITMAP_TOTAL_SIZE)      // 0x00010000 - 65,536 bytes
+    uart_printf(LITERAL("No memory of size left %x"), size);
 
-#define MEDIUM_SIZE_BYTES           1024
-#define MEDIUM_SIZE_TOTAL           (MEDIUM_SIZE_BYTES * BITMAP_TOTAL_SIZE)     // 0x00100000 - 1,048,576 bytes
+    halt();
+}
 
-#define LARGE_SIZE_BYTES            16384
-#define LARGE_SIZE_TOTAL            (LARGE_SIZE_BYTES * BITMAP_TOTAL_SIZE)      // 0x01000000 - 16,777,216 bytes
+static __attribute__((__noreturn__)) void panic_bad_pointer(void *ptr) {
+    uart_printf(LITERAL("Invalid pool pointer %x"), (uint64) ptr);
 
-// Let's keep track of where we last saw free memory to speed up scans
+    halt();
+}
 
-static uint8 small_pool_first_bit = 0;     // The first double word a free page was last seen in, to save time
-static uint8 medium_pool_first_bit = 0;    // 0xFF means we're full
-static uint8 large_pool_first_bit = 0;
+static uint8 find_first_unset_bit_from_left(uint64 double_word) {
+    // CLS counts how many bits match the high bit, so we need to check the high bit is set
+    // If not then that means the first unset bit is the highest bit, 0 from left
 
-// Where the bitmaps exist in memory, starting at we've decided is a safe address
+    if ((double_word & 0x8000000000000000) == 0)
+        return 0;
 
-static uint64 * const small_memory_bitmap = SAFE_MEMORY_START;                         // 0x00100000
-static uint64 * const medium_memory_bitmap = SAFE_MEMORY_START + BITMAP_TOTAL_SIZE;    // 0x00100400
-static uint64 * const large_memory_bitmap = SAFE_MEMORY_START + BITMAP_TOTAL_SIZE * 2; // 0x00100800
+    uint64 result;
 
-// Where the actual allocation pools are, right after the bitmaps
+    asm ("cls %0, %1"
+            : "=r" (result)
+            : "r" (double_word));
 
-static void * const small_pool_start = SAFE_MEMORY_START + BITMAP_TOTAL_SIZE * 3;      // 0x00100C00
-static void * const medium_pool_start = SAFE_MEMORY_START + BITMAP_TOTAL_SIZE * 3      // 0x00200C00
-                                                    + SMALL_SIZE_TOTAL;
-static void * const large_pool_start = SAFE_MEMORY_START + BITMAP_TOTAL_SIZE * 3       // 0x01200C00
-                                                    + SMALL_SIZE_TOTAL
-                                                    + MEDIUM_SIZE_TOTAL;
+    // CLS counts bits after the sign bit, so this will return 1 to 64
 
-// Local functions
+    return (uint8) result + 1;
+}
 
-static __attribute__((__noreturn__)) void panic_out_of_memory(uint16 size) {
-    // This is hardcoded so we don't have to allocate memory
+static uint8 find_first_set_bit_from_left(uint64 double_word) {
+    // CLZ counts the zeros before the first set bit, so this will return 0 to 63, or 64 if nothing is set
 
-    char error[] = {0, 0, 'N', 'o', ' ', 'm', 'e', 'm', 'o', 'r', 'y', ' ',
-                            'o', 'f', ' ', 's', 'i', 'z' ,'e', ' ', 'l', 'e', 'f', 't', ' '};
+    uint64 result;
 
-    string *s = (string *) &error;
-    s->size = sizeof(error);
+    asm ("clz %0, %1"
+            : "=r" (result)
+            : "r" (double_word));
 
-    uart_send_string(s);
+    return (uint8) result;
+}
 
-    uart_send_word_in_hex((uint32) size, true);
+static uint64 bit_from_left(uint8 bit) {
+    // Turns a bit position counted from the left (0 to 63) into a mask
 
-    while (true) {};
+    return 0x8000000000000000 >> bit;
 }
 
-static __attribute__((__noreturn__)) void panic_bad_pointer(void *ptr) {
-    // This is hardcoded so we don't have to allocate memory
+static void init_pool(memory_pool *pool) {
+    // Every block starts free, so clear the bitmap and mark every bitmap double word as having space.
+    // The index is filled a double word at a time so this stays quick with a quarter million blocks.
 
-    char error[] = {0, 0, 'I', 'n', 'v', 'a', 'l', 'i', 'd', ' ',
-                            'p', 'o', 'o', 'l', ' ', 'p', 'o', 'i', 'n', 't', 'e', 'r', ' '};
+    uint32 double_words = (pool->blocks + DOUBLE_WORD_BITS - 1) / DOUBLE_WORD_BITS;
+    uint32 summary_double_words = (double_words + DOUBLE_WORD_BITS - 1) / DOUBLE_WORD_BITS;
 
-    string *s = (string *) &error;
-    s->size = sizeof(error);
+    zero_memory((void *) pool->bitmap, double_words * 8);
 
-    uart_send_string(s);
+    for (uint32 i = 0; i < summary_double_words; i++)
+        pool->summary[i] = ~0ULL;
 
-    uart_send_word_in_hex((uint64) ptr >> 32, true);
-    uart_send_word_in_hex((uint64) ptr & 0xFFFFFFFF, false);
+    if (double_words % DOUBLE_WORD_BITS != 0)
+        pool->summary[summary_double_words - 1] = ~(~0ULL >> (double_words % DOUBLE_WORD_BITS));
 
-    while (true) {};
+    pool->top = summary_double_words == 0 ? 0 : ~(~0ULL >> 1 >> (summary_double_words - 1));
+
+    // If the block count isn't a multiple of 64 mark the bits past the end as used so they're never handed out
+
+    if (pool->blocks % DOUBLE_WORD_BITS != 0)
+        pool->bitmap[double_words - 1] = ~0ULL >> (pool->blocks % DOUBLE_WORD_BITS);
 }
 
-static uint8 find_first_unset_bit_from_left(uint64 double_word) {
-    // CLS counts how many bits match the high bit, so we need to check the high bit is set
-    // If not then that means the first unset bit is the highest bit, 0 from left
+static void *find_memory_end() {
+    // Ask the GPU where the ARM's memory is
 
-    if ((double_word & 0x8000000000000000) == 0)
+    mailbox_data[0] = 8 * 4;                        // Length of message in bytes (8 ints, which are 4 bytes each)
+    mailbox_data[1] = MAILBOX_REQUEST;              // We're sending a request
+
+    mailbox_data[2] = MAILBOX_TAG_GET_ARM_MEMORY;   // We want the ARM memory base and size
+    mailbox_data[3] = 8;                            // Buffer size
+    mailbox_data[4] = 0;                            // Response size (we pre-set 0, the GPU will set the real response size)
+    mailbox_data[5] = 0;                            // Base address comes back here
+    mailbox_data[6] = 0;                            // Size in bytes comes back here
+
+    mailbox_data[7] = MAILBOX_TAG_LAST;             // We're done sending tags
+
+    if (!mailbox_call(MAILBOX_CHANNEL_PROPERTY_TAGS) || mailbox_data[1] != MAILBOX_RESPONSE || mailbox_data[6] == 0)
+        return FALLBACK_MEMORY_END;
+
+    return (void *) ((uint64) mailbox_data[5] + (uint64) mailbox_data[6]);
+}
+
+static uint8 size_class_for(uint64 size) {
+    // The smallest class is 64 bytes (2^6), so the class is how many bits past that the size needs.
+    // Sizes that are too big come back as SIZE_CLASS_COUNT so no pool matches.
+
+    if (size <= MINIMUM_ALLOCATION_BYTES)
         return 0;
 
-    uint64 result;
+    uint8 bits_needed = DOUBLE_WORD_BITS - find_first_set_bit_from_left(size - 1);
+    uint8 size_class = bits_needed - pools[0].block_shift;
 
-    asm ("cls %0, %1"
-            : "=r" (result)
-            : "r" (double_word));
+    return size_class < SIZE_CLASS_COUNT ? size_class : SIZE_CLASS_COUNT;
+}
 
-    // CLS counts bits after the sign bit, so this will return 1 to 64
+static memory_pool *find_pool(void *ptr) {
+    // Pools are laid out in order, so find the one containing the pointer and check it's the start of a block
 
-    return (uint8) result + 1;
+    for (uint8 i = 0; i < SIZE_CLASS_COUNT; i++) {
+        if (ptr >= pools[i].start && ptr < pools[i].end) {
+            if (((uint64) (ptr - pools[i].start) & (pools[i].block_size - 1)) != 0)
+                panic_bad_pointer(ptr);
+
+            return &pools[i];
+        }
+    }
+
+    panic_bad_pointer(ptr);
 }
 
-static void zero_memory_by_eight(void *ptr, uint16 size_divisble_by_8) {
-    for (uint16 i = 0; i < size_divisble_by_8 / 8; i++)
-        ((uint64 *) ptr)[i] = 0;
+static uint8 page_order_for(uint64 size) {
+    // How many times we have to double one page to hold size bytes, or more than the maximum if we can't
+
+    if (size <= PAGE_SIZE)
+        return 0;
+
+    return DOUBLE_WORD_BITS - find_first_set_bit_from_left(size - 1) - PAGE_SHIFT;
 }
 
-static void zero_memory_by_one(void *ptr, uint16 size) {
-    for (uint16 i = 0; i < size; i++)
-        ((uint8 *) ptr)[i] = 0;
+static void push_free_page_block(uint64 page, uint8 order) {
+    free_page_block *block = pages_start + (page << PAGE_SHIFT);
+
+    block->previous = null;
+    block->next = free_page_lists[order];
+
+    if (block->next != null)
+        block->next->previous = block;
+
+    free_page_lists[order] = block;
+    page_orders[page] = PAGE_FREE | order;
 }
 
-static void copy_memory_by_eight(void *src, void *dest, uint16 size_divisble_by_8) {
-    for (uint16 i = 0; i < size_divisble_by_8 / 8; i++)
-        ((uint64 *) dest)[i] = ((uint64 *) src)[i];
+static void remove_free_page_block(uint64 page, uint8 order) {
+    free_page_block *block = pages_start + (page << PAGE_SHIFT);
+
+    if (block->previous != null)
+        block->previous->next = block->next;
+    else
+        free_page_lists[order] = block->next;
+
+    if (block->next != null)
+        block->next->previous = block->previous;
 }
 
-static void copy_memory_by_one(void *src, void *dest, uint16 size) {
-    for (uint16 i = 0; i < size; i++)
-        ((uint8 *) dest)[i] = ((uint8 *) src)[i];
+static void init_pages(void *start, void *end) {
+    // Each page needs a byte of tracking, put that first then start the pages on a page boundary
+
+    uint64 available = end > start ? (uint64) (end - start) : 0;
+
+    page_count = available > PAGE_SIZE ? (available - PAGE_SIZE) / (PAGE_SIZE + 1) : 0;
+    page_orders = start;
+
+    pages_start = (void *) (((uint64) start + page_count + PAGE_SIZE - 1) & ~((uint64) PAGE_SIZE - 1));
+    pages_end = pages_start + (page_count << PAGE_SHIFT);
+
+    // Nothing is a block yet
+
+    for (uint64 i = 0; i < page_count / 8; i++)
+        ((uint64 *) page_orders)[i] = ~0ULL;
+
+    for (uint64 i = page_count & ~7ULL; i < page_count; i++)
+        page_orders[i] = PAGE_NOT_HEAD;
+
+    for (uint8 i = 0; i <= MAXIMUM_PAGE_ORDER; i++)
+        free_page_lists[i] = null;
+
+    // Carve the pages up into the biggest blocks we can. A block has to start on a multiple of its size.
+
+    uint64 page = 0;
+
+    while (page < page_count) {
+        uint8 order = MAXIMUM_PAGE_ORDER;
+
+        while ((page & ((1ULL << order) - 1)) != 0 || page + (1ULL << order) > page_count)
+            order--;
+
+        push_free_page_block(page, order);
+
+        page += 1ULL << order;
+    }
 }
 
-// Functions
+static void clear_top_hint(memory_pool *pool, uint8 summary_double_word) {
+    // The summary double word looked empty. If a free set a bit in it while we cleared the hint, put it back.
 
-void init_memory_pools() {
-    // Clear all the bits in our tracking pools
+    atomic_clear_bits(&pool->top, bit_from_left(summary_double_word));
 
-    zero_memory((void *) small_memory_bitmap, BITMAP_BYTES);
-    zero_memory((void *) medium_memory_bitmap, BITMAP_BYTES);
-    zero_memory((void *) large_memory_bitmap, BITMAP_BYTES);
+    if (pool->summary[summary_double_word] != 0)
+        atomic_set_bits(&pool->top, bit_from_left(summary_double_word));
 }
 
-void zero_memory(void *ptr, uint16 size) {
-    uint64 remainder = size % 8;
-    uint64 main_chunk = size - remainder;
+static void clear_summary_hint(memory_pool *pool, uint32 double_word) {
+    // The bitmap double word looked full. If a free made space in it while we cleared the hint, put it back.
+
+    uint8 summary_double_word = double_word / DOUBLE_WORD_BITS;
+    uint64 summary_bit = bit_from_left(double_word % DOUBLE_WORD_BITS);
+
+    uint64 summary = atomic_clear_bits(&pool->summary[summary_double_word], summary_bit) & ~summary_bit;
 
-    zero_memory_by_eight(ptr, main_chunk);
-    zero_memory_by_one((void *) ((uint64) ptr + main_chunk), remainder);
+    if (pool->bitmap[double_word] != ~0ULL) {
+        atomic_set_bits(&pool->summary[summary_double_word], summary_bit);
+        atomic_set_bits(&pool->top, bit_from_left(summary_double_word));
+    } else if (summary == 0) {
+        clear_top_hint(pool, summary_double_word);
+    }
 }
 
-void copy_memory(void *src, void *dest, uint16 size) {
-    uint64 remainder = size % 8;
-    uint64 main_chunk = size - remainder;
+static void *claim_block(memory_pool *pool) {
+    // Walk down the index: the top finds a summary double word with space, that finds a bitmap double word
+    // with space, and that finds the free block. Another core can get there first at any step, if so we
+    // fix up any stale hint and start again. Returns null once the top says the pool is full.
+
+    while (true) {
+        uint64 top = pool->top;
+
+        if (top == 0)
+            return null;
+
+        uint8 summary_double_word = find_first_set_bit_from_left(top);
+        uint64 summary = pool->summary[summary_double_word];
+
+        if (summary == 0) {
+            clear_top_hint(pool, summary_double_word);
+            continue;
+        }
+
+        uint32 double_word_with_clear_bit = summary_double_word * DOUBLE_WORD_BITS + find_first_set_bit_from_left(summary);
+        uint64 double_word = pool->bitmap[double_word_with_clear_bit];
+        uint8 clear_bit_from_left = find_first_unset_bit_from_left(double_word);
+
+        if (clear_bit_from_left == DOUBLE_WORD_BITS) {
+            clear_summary_hint(pool, double_word_with_clear_bit);
+            continue;
+        }
+
+        // Mark the block as used, only if nobody changed the double word since we looked at it
+
+        uint64 claimed = double_word | bit_from_left(clear_bit_from_left);
+
+        if (!atomic_compare_and_swap(&pool->bitmap[double_word_with_clear_bit], double_word, claimed))
+            continue;
+
+        // Clear the index bits above it if that filled them up
+
+        if (claimed == ~0ULL)
+            clear_summary_hint(pool, double_word_with_clear_bit);
+
+        // Adjust our offset from double word relative, to full pool relative
 
-    copy_memory_by_eight(src, dest, main_chunk);
-    copy_memory_by_one((void *) ((uint64) src + main_chunk), (void *) ((uint64) dest + main_chunk), remainder);
+        uint32 block = DOUBLE_WORD_BITS * double_word_with_clear_bit + clear_bit_from_left;
+
+        return pool->start + ((uint64) block << pool->block_shift);
+    }
 }
 
-void free(void **ptr) {
-    // Freeing null is allowed and is a no-op
+static void release_block(memory_pool *pool, void *ptr) {
+    // Figure out which bit of the bitmap the block was, zero to the left
 
-    if (*ptr == null)
-        return;
+    uint32 bit_of_total = (uint64) (ptr - pool->start) >> pool->block_shift;
+    uint32 double_word_with_bit = bit_of_total / DOUBLE_WORD_BITS;
+    uint32 summary_double_word = double_word_with_bit / DOUBLE_WORD_BITS;
+    uint64 summary_bit = bit_from_left(double_word_with_bit % DOUBLE_WORD_BITS);
+
+    // Free it in the bitmap, then record that its double word (and summary double word) now have space.
+    // The hints are usually already set, checking first saves writing to lines every core reads.
+
+    atomic_clear_bits(&pool->bitmap[double_word_with_bit], bit_from_left(bit_of_total % DOUBLE_WORD_BITS));
+
+    if ((pool->summary[summary_double_word] & summary_bit) == 0)
+        atomic_set_bits(&pool->summary[summary_double_word], summary_bit);
 
-    // Figure out which pool we're in
-
-    uint64 *bitmap;
-    void *offset;
-    uint16 size;
-    uint8 *first_bit;
-
-    if (*ptr >= small_pool_start && *ptr < medium_pool_start) {
-        offset = (void *) (*ptr - small_pool_start);
-        bitmap = (void *) small_memory_bitmap;
-        size = SMALL_SIZE_BYTES;
-        first_bit = &small_pool_first_bit;
-    } else if (*ptr >= medium_pool_start && *ptr < large_pool_start) {
-        offset = (void *) (*ptr - medium_pool_start);
-        bitmap = (void *) medium_memory_bitmap;
-        size = MEDIUM_SIZE_BYTES;
-        first_bit = &medium_pool_first_bit;
-    } else if (*ptr >= large_pool_start && *ptr < large_pool_start + LARGE_SIZE_TOTAL) {
-        offset = (void *) (*ptr - large_pool_start);
-        bitmap = (void *) large_memory_bitmap;
-        size = LARGE_SIZE_BYTES;
-        first_bit = &large_pool_first_bit;
-    } else {
-       panic_bad_pointer(*ptr);
+    if ((pool->top & bit_from_left(summary_double_word)) == 0)
+        atomic_set_bits(&pool->top, bit_from_left(summary_double_word));
+}
+
+static void *take_zeroed_block(memory_pool *pool) {
+    // Returns null if another core beat us to the last one
+
+    void *address = null;
+
+    acquire_lock(&pool->lock);
+
+    if (pool->zeroed_count != 0)
+        address = pool->zeroed[--pool->zeroed_count];
+
+    release_lock(&pool->lock);
+
+    return address;
+}
+
+static void refill_magazine(magazine *mag, memory_pool *pool) {
+    // Take a batch of blocks from the pool
+
+    while (mag->count < MAGAZINE_BATCH) {
+        void *address = claim_block(pool);
+
+        if (address == null)
+            break;
+
+        mag->blocks[mag->count++] = address;
     }
 
-    // Figure out which bit of the bitmap the page was, zero to the right
+    // The zeroed blocks are saved for allocate(), unless they're all that's left
 
-    uint16 bit_of_total = (uint64) offset / size;                       // 0 to 1023
-    uint8 double_word_with_bit = bit_of_total / DOUBLE_WORD_BITS;       // 0 to 15
+    if (mag->count == 0 && pool->zeroed_count != 0) {
+        void *address = take_zeroed_block(pool);
 
-    if (double_word_with_bit < *first_bit) {
-       *first_bit = double_word_with_bit;
+        if (address != null)
+            mag->blocks[mag->count++] = address;
     }
+}
 
-    // Free it in the bitmap
+static void drain_magazine(magazine *mag, memory_pool *pool) {
+    // Give the oldest batch back to the pool, they're the least likely to still be in the cache
 
-    uint8 bit_in_double_word = bit_of_total % DOUBLE_WORD_BITS;         // 0 to 63
-    uint8 bit_from_left = DOUBLE_WORD_BITS - 1 - bit_in_double_word;    // Now 63 to 0
+    for (uint8 i = 0; i < MAGAZINE_BATCH; i++)
+        release_block(pool, mag->blocks[i]);
 
-    bitmap[double_word_with_bit] &= ~(1 << bit_from_left);
+    // Slide the rest down
 
-    // Now zero out the original pointer
+    for (uint8 i = MAGAZINE_BATCH; i < mag->count; i++)
+        mag->blocks[i - MAGAZINE_BATCH] = mag->blocks[i];
 
-    *ptr = null;
+    mag->count -= MAGAZINE_BATCH;
+}
+
+static void *take_block(uint8 size_class, uint64 size) {
+    // Pop a block from this core's magazine for the class. If it's empty and the pool is full we'll
+    // borrow a block from the next bigger class that has one. IRQs are masked so the thread can't be
+    // switched out (or moved to another core) while it's in the middle of a magazine.
+
+    uint64 interrupts = save_and_disable_interrupts();
+    magazine *core_magazines = magazines[this_core()->core];
+
+    for (uint8 i = size_class; i < SIZE_CLASS_COUNT; i++) {
+        magazine *mag = &core_magazines[i];
+
+        if (mag->count == 0)
+            refill_magazine(mag, &pools[i]);
+
+        if (mag->count != 0) {
+            void *address = mag->blocks[--mag->count];
+
+            restore_interrupts(interrupts);
+
+            return address;
+        }
+    }
+
+    panic_out_of_memory(size);
 }
 
-void *allocate(uint16 size) {
-    // Find the size class
-
-    uint64 *bitmap;
-    void *pool;
-    uint8 *pool_first_bit;
-
-    if (size <= SMALL_SIZE_BYTES && small_pool_first_bit != 0xFF) {
-        bitmap = (uint64 *) small_memory_bitmap;
-        pool = small_pool_start;
-        pool_first_bit = &small_pool_first_bit;
-        size = SMALL_SIZE_BYTES;
-    } else if (size <= MEDIUM_SIZE_BYTES && medium_pool_first_bit != 0xFF) {
-        bitmap = (uint64 *) medium_memory_bitmap;
-        pool = medium_pool_start;
-        pool_first_bit = &medium_pool_first_bit;
-        size = MEDIUM_SIZE_BYTES;
-    } else if (size <= LARGE_SIZE_BYTES && large_pool_first_bit != 0xFF) {
-        bitmap = (uint64 *) large_memory_bitmap;
-        pool = large_pool_start;
-        pool_first_bit = &large_pool_first_bit;
-        size = LARGE_SIZE_BYTES;
-    } else {
+static void *claim_pages(uint64 size) {
+    // Find the smallest order that fits, then the smallest free block at least that big
+
+    uint8 order = page_order_for(size);
+
+    if (order > MAXIMUM_PAGE_ORDER)
         panic_out_of_memory(size);
+
+    acquire_lock(&page_lock);
+
+    uint8 found = order;
+
+    while (found <= MAXIMUM_PAGE_ORDER && free_page_lists[found] == null)
+        found++;
+
+    if (found > MAXIMUM_PAGE_ORDER)
+        panic_out_of_memory(size);
+
+    uint64 page = (uint64) ((void *) free_page_lists[found] - pages_start) >> PAGE_SHIFT;
+
+    remove_free_page_block(page, found);
+
+    // Split it in half until it's the size we want, the upper halves go back on the free lists
+
+    while (found > order) {
+        found--;
+
+        push_free_page_block(page + (1ULL << found), found);
     }
 
-    // Find a free block
+    page_orders[page] = order;
 
-    uint8 double_word_with_clear_bit = 0xFF;
-    uint16 clear_bit_from_left;
+    release_lock(&page_lock);
 
-    for (uint8 i = *pool_first_bit; i < BITMAP_DOUBLE_WORDS; i++) {
-        clear_bit_from_left = find_first_unset_bit_from_left(bitmap[i]);    // 0 to 63 if found, 64 if not
+    return pages_start + (page << PAGE_SHIFT);
+}
 
-        if (clear_bit_from_left != DOUBLE_WORD_BITS) {
-            double_word_with_clear_bit = i;
-            break;
+static void *claim_zeroed_pages(uint64 size) {
+    void *address = claim_pages(size);
+
+    zero_memory(address, (uint64) PAGE_SIZE << page_order_for(size));
+
+    return address;
+}
+
+static bool resize_pages_in_place(void *ptr, uint64 size) {
+    // Change the order of the block at ptr without moving it, returns false if it would have to move
+
+    uint8 wanted = page_order_for(size);
+
+    if (wanted > MAXIMUM_PAGE_ORDER)
+        panic_out_of_memory(size);
+
+    acquire_lock(&page_lock);
+
+    uint64 page = (uint64) (ptr - pages_start) >> PAGE_SHIFT;
+    uint8 order = page_orders[page];
+
+    if (order > MAXIMUM_PAGE_ORDER)
+        panic_bad_pointer(ptr);
+
+    // Shrinking always works, the upper halves go back on the free lists. Their buddies are the
+    // lower halves we're keeping, so there's nothing for them to merge with.
+
+    while (order > wanted) {
+        order--;
+
+        push_free_page_block(page + (1ULL << order), order);
+    }
+
+    // Growing works if we're the lower half at each order up to the one we want and each upper half is free
+
+    bool fits = true;
+
+    for (uint8 i = order; i < wanted && fits; i++) {
+        uint64 buddy = page + (1ULL << i);
+
+        fits = (page & ((2ULL << i) - 1)) == 0 && buddy + (1ULL << i) <= page_count &&
+                    page_orders[buddy] == (PAGE_FREE | i);
+    }
+
+    if (fits) {
+        for (; order < wanted; order++) {
+            uint64 buddy = page + (1ULL << order);
+
+            remove_free_page_block(buddy, order);
+
+            page_orders[buddy] = PAGE_NOT_HEAD;
         }
     }
 
-    if (clear_bit_from_left == DOUBLE_WORD_BITS) {
-        // Shouldn't get here. If we do it's a bug, we'll use a sentinel value
-        panic_out_of_memory(0xDEAD);
+    page_orders[page] = order;
+
+    release_lock(&page_lock);
+
+    return fits;
+}
+
+// Functions
+
+void init_memory_pools() {
+    // Figure out what memory we have to work with, from after the kernel to the end of RAM
+
+    void *start = (void *) (((uint64) _end + MEMORY_ALIGNMENT - 1) & ~((uint64) MEMORY_ALIGNMENT - 1));
+    void *end = find_memory_end();
+
+    if (start < SAFE_MEMORY_START)
+        start = SAFE_MEMORY_START;
+
+    if (end <= start)
+        panic_out_of_memory(0);
+
+    uint64 available = (uint64) (end - start);
+
+    // Size each class from its share. Every block costs its size plus a bit in the bitmap and a little
+    // bit of index, so count a byte of overhead per block and leave room to align the pool.
+
+    for (uint8 i = 0; i < SIZE_CLASS_COUNT; i++) {
+        uint64 share = available / 100 * pools[i].percent;
+        uint64 blocks = share > pools[i].block_size ? (share - pools[i].block_size) / (pools[i].block_size + 1) : 0;
+
+        pools[i].blocks = blocks < MAXIMUM_POOL_BLOCKS ? blocks : MAXIMUM_POOL_BLOCKS;
+    }
+
+    // Lay out every bitmap and index first, then the pools themselves, then the pages with whatever is left
+
+    void *next = start;
+
+    for (uint8 i = 0; i < SIZE_CLASS_COUNT; i++) {
+        uint32 double_words = (pools[i].blocks + DOUBLE_WORD_BITS - 1) / DOUBLE_WORD_BITS;
+
+        pools[i].bitmap = next;
+        next += double_words * 8;
+
+        pools[i].summary = next;
+        next += (double_words + DOUBLE_WORD_BITS - 1) / DOUBLE_WORD_BITS * 8;
+    }
+
+    for (uint8 i = 0; i < SIZE_CLASS_COUNT; i++) {
+        // Align each pool to its block size, it's never more than 16k
+
+        next = (void *) (((uint64) next + pools[i].block_size - 1) & ~((uint64) pools[i].block_size - 1));
+
+        pools[i].start = next;
+        next += (uint64) pools[i].blocks << pools[i].block_shift;
+        pools[i].end = next;
     }
 
-    // Calculate the bit number for the shift, then set it in the bitmap
+    // Clear all the bits in our tracking pools and build the indexes on top of them
 
-    uint8 bit_from_right = DOUBLE_WORD_BITS - clear_bit_from_left - 1;      // Now 63 to 0
+    for (uint8 i = 0; i < SIZE_CLASS_COUNT; i++)
+        init_pool(&pools[i]);
 
-    bitmap[double_word_with_clear_bit] |= (1 << bit_from_right);
+    init_pages(next, end);
+}
 
-    // Either update first_pool_bit or mark that we're full
+void free(void **ptr) {
+    // Freeing null is allowed and is a no-op
+
+    if (*ptr == null)
+        return;
 
-    if (bitmap[double_word_with_clear_bit] == ~0 && double_word_with_clear_bit == BITMAP_DOUBLE_WORDS - 1) {
-        // We were in the last double word and set the last bit (~0 = all Fs)
-        *pool_first_bit = 0xFF;     // Mark we're full
-    } else {
-        // Things aren't full, record this double word as where the last clear bit was seen
-        *pool_first_bit = double_word_with_clear_bit;
+    // Pages have their own allocator
+
+    if (*ptr >= pages_start && *ptr < pages_end) {
+        free_pages(ptr);
+        return;
     }
 
-    // Adjust our offset from double word relative, to full pool relative
+    // Figure out which pool we're in, the block goes in this core's magazine for it (with IRQs masked,
+    // like in take_block())
+
+    memory_pool *pool = find_pool(*ptr);
+    uint64 interrupts = save_and_disable_interrupts();
+    magazine *mag = &magazines[this_core()->core][pool - pools];
+
+    if (mag->count == MAGAZINE_BLOCKS)
+        drain_magazine(mag, pool);
+
+    mag->blocks[mag->count++] = *ptr;
 
-    clear_bit_from_left += DOUBLE_WORD_BITS * double_word_with_clear_bit;
+    restore_interrupts(interrupts);
 
-    void *address = pool + (clear_bit_from_left * size);
+    // Now zero out the original pointer
+
+    *ptr = null;
+}
+
+void *allocate(uint64 size) {
+#ifdef BENCHMARKS
+    allocation_count++;
+#endif
+
+    // Big things come from the page allocator
+
+    if (size > LARGEST_CLASS_BYTES)
+        return claim_zeroed_pages(size);
+
+    uint8 size_class = size_class_for(size);
+    memory_pool *pool = &pools[size_class];
+
+    // If the idle loop zeroed a block for us ahead of time, use that. Only take the lock if it looks like it.
+
+    if (pool->zeroed_count != 0) {
+        void *address = take_zeroed_block(pool);
+
+        if (address != null)
+            return address;
+    }
 
-    // Zero and return
+    // Otherwise take one from our magazine and zero it
 
-    zero_memory(address, size);
+    void *address = take_block(size_class, size);
+
+    zero_memory(address, pool->block_size);
 
     return address;
 }
 
-void reallocate(void **ptr, uint16 size) {
-    // First figure out if it already fits (original size was less than the block, or we had to borrow a bigger block)
+void *allocate_uninitialized(uint64 size) {
+#ifdef BENCHMARKS
+    allocation_count++;
+#endif
 
-    uint16 current;
+    // Big things come from the page allocator
 
-    if (size <= SMALL_SIZE_BYTES) {
-        current = SMALL_SIZE_BYTES;
-    } else if (size <= MEDIUM_SIZE_BYTES) {
-        current = MEDIUM_SIZE_BYTES;
-    } else if (size <= LARGE_SIZE_BYTES) {
-        current = LARGE_SIZE_BYTES;
-    } else {
-        panic_bad_pointer(*ptr);
+    if (size > LARGEST_CLASS_BYTES)
+        return claim_pages(size);
+
+    return take_block(size_class_for(size), size);
+}
+
+bool prepare_zeroed_blocks() {
+    // Top up one class's zeroed blocks by one, largest first since those save the most time.
+    // Doing one block per call keeps each call short, returns false once there's nothing left to do.
+
+    for (uint8 i = SIZE_CLASS_COUNT; i > 0; i--) {
+        memory_pool *pool = &pools[i - 1];
+        void *address = null;
+
+        if (pool->zeroed_count < ZEROED_BLOCKS_PER_CLASS)
+            address = claim_block(pool);
+
+        if (address == null)
+            continue;
+
+        // Zero it, then add it to the list. If another core filled the list while we did, give the block back.
+
+        zero_memory(address, pool->block_size);
+
+        acquire_lock(&pool->lock);
+
+        bool room = pool->zeroed_count < ZEROED_BLOCKS_PER_CLASS;
+
+        if (room)
+            pool->zeroed[pool->zeroed_count++] = address;
+
+        release_lock(&pool->lock);
+
+        if (!room)
+            release_block(pool, address);
+
+        return true;
     }
 
-    if (size <= current)
-        return;             // Already fits
+    return false;
+}
 
-    // Ok, we'll allocate what they want
+void reallocate(void **ptr, uint64 size, uint64 used) {
+    // Reallocating null is just allocating
 
-    void *result = allocate(size);
+    if (*ptr == null) {
+        *ptr = allocate(size);
+        return;
+    }
+
+    // Pages can grow into their free buddies or give their upper halves back without moving
+
+    bool in_pages = *ptr >= pages_start && *ptr < pages_end;
+
+    if (in_pages && size > LARGEST_CLASS_BYTES && resize_pages_in_place(*ptr, size))
+        return;
+
+    // See what block the pointer really has (we may have borrowed a bigger one). If the size fits and
+    // more than half of the block would still be used, leave it be.
+
+    uint64 current = memory_block_size(*ptr);
+
+    if (size <= current && size > current / 2)
+        return;
 
-    // Copy the full block since we don't know much they were using
+    // Ok, we'll allocate what they want, it doesn't need zeroing since we're about to copy over it
 
-    copy_memory(*ptr, result, current);
+    void *result = allocate_uninitialized(size);
+
+    // Only copy what they were using, and only what fits if it's shrinking
+
+    if (used > current)
+        used = current;
+
+    copy_memory(*ptr, result, used < size ? used : size);
 
     // Free the old memory, and update the pointer
 
@@ -305,3 +797,76 @@ void reallocate(void **ptr, uint16 size) {
 
     *ptr = result;
 }
+
+void *allocate_pages(uint64 size) {
+#ifdef BENCHMARKS
+    allocation_count++;
+#endif
+
+    return claim_zeroed_pages(size);
+}
+
+void free_pages(void **ptr) {
+    // Freeing null is allowed and is a no-op
+
+    if (*ptr == null)
+        return;
+
+    // Make sure it's the start of a block that's in use
+
+    if (*ptr < pages_start || *ptr >= pages_end || ((uint64) *ptr & (PAGE_SIZE - 1)) != 0)
+        panic_bad_pointer(*ptr);
+
+    acquire_lock(&page_lock);
+
+    uint64 page = (uint64) (*ptr - pages_start) >> PAGE_SHIFT;
+    uint8 order = page_orders[page];
+
+    if (order > MAXIMUM_PAGE_ORDER)
+        panic_bad_pointer(*ptr);
+
+    // Merge with our buddy (the other half of the block one order up) for as long as it's free
+
+    while (order < MAXIMUM_PAGE_ORDER) {
+        uint64 buddy = page ^ (1ULL << order);
+
+        if (buddy + (1ULL << order) > page_count || page_orders[buddy] != (PAGE_FREE | order))
+            break;
+
+        remove_free_page_block(buddy, order);
+
+        // Whichever is higher is now in the middle of the merged block
+
+        if (buddy > page) {
+            page_orders[buddy] = PAGE_NOT_HEAD;
+        } else {
+            page_orders[page] = PAGE_NOT_HEAD;
+            page = buddy;
+        }
+
+        order++;
+    }
+
+    push_free_page_block(page, order);
+
+    release_lock(&page_lock);
+
+    // Now zero out the original pointer
+
+    *ptr = null;
+}
+
+uint64 memory_block_size(void *ptr) {
+    // Pages keep their order in page_orders, blocks are whatever size their pool hands out
+
+    if (ptr >= pages_start && ptr < pages_end) {
+        uint8 order = page_orders[(uint64) (ptr - pages_start) >> PAGE_SHIFT];
+
+        if (order > MAXIMUM_PAGE_ORDER)
+            panic_bad_pointer(ptr);
+
+        return (uint64) PAGE_SIZE << order;
+    }
+
+    return find_pool(ptr)->block_size;
+}
@@ -5,25 +5,43 @@
 
 #define MINIMUM_ALLOCATION_BYTES        64
 
-// Initializes the dynamic kernel memory subsystem
+// How many allocations have been made, only counted in make bench builds
+extern uint64 allocation_count;
+
+// Initializes the dynamic kernel memory subsystem, init_smp() must have run first
 void init_memory_pools();
 
 // Frees the memory pointed to and nulls out the pointer
 void free(void **ptr);
 
 // Allocates the requested mount of memory, panics on failure, returning a pointer
-void *allocate(uint16 size);
+// Anything over 16k comes from the page allocator, smaller blocks come from this core's magazines
+void *allocate(uint64 size);
+
+// Allocates like allocate() but the memory isn't zeroed, for callers about to overwrite all of it
+void *allocate_uninitialized(uint64 size);
+
+// Does one step of zeroing blocks ahead of time so allocate() doesn't have to, for the idle loop
+// Returns false when there is nothing left to prepare
+bool prepare_zeroed_blocks();
+
+// Resizes the block to hold the requested mount of memory, panics on failure, updates the pointer
+// Only the first used bytes are kept, anything past them (or past the old block) isn't zeroed
+void reallocate(void **ptr, uint64 size, uint64 used);
+
+// Allocates a page aligned block of a power of two pages (4k up to 64 megs) big enough for size bytes
+void *allocate_pages(uint64 size);
 
-// Increases the size of the block the requested mount of memory, panics on failure, updates the pointer
-void reallocate(void **ptr, uint16 size);
+// Frees the pages pointed to and nulls out the pointer, free() also works on pages
+void free_pages(void **ptr);
 
 // Peek under the covers are return just how big the block of memory is
-uint16 memory_block_size(void *ptr);
+uint64 memory_block_size(void *ptr);
 
 // Zeros a block of memory
-void zero_memory(void *prt, uint16 size);
+void zero_memory(void *prt, uint64 size);
 
 // Copies the size bytes from src to dest
-void copy_memory(void *src, void *dest, uint16 size);
+void copy_memory(void *src, void *dest, uint64 size);
 
 #endif
@@ -0,0 +1,58 @@
+#include "types.h"
+#include "irq.h"
+
+#ifndef __mini_uart_h__
+#define	__mini_uart_h__
+
+// The mini UART's side of uart.c, which includes this unless built with PL011=1 (then it's pl011.h).
+// Only uart.c should include it. The setup is in mini_uart.S.
+
+#define AUX_MINI_UART_IO_DATA           ((volatile uint32 *) 0x3F215040)
+#define AUX_MINI_UART_INTERRUPT_ENABLE  ((volatile uint32 *) 0x3F215044)
+#define AUX_MINI_UART_LINE_STATUS       ((volatile uint32 *) 0x3F215054)
+#define AUX_MINI_UART_EXTRA_STATS       ((volatile uint32 *) 0x3F215064)
+
+#define LINE_STATUS_DATA_READY          (1 << 0)                    // There's a byte to read
+
+#define MINI_UART_FIFO_BYTES            8
+
+// The datasheet has the receive and transmit bits the wrong way around, and bits 2 and 3 have to be set
+// for any interrupt to happen
+#define INTERRUPTS_RECEIVE              0x0D
+#define INTERRUPTS_RECEIVE_AND_TRANSMIT 0x0F
+
+#define UART_IRQ                        IRQ_AUX
+
+extern void mini_uart_init_hardware();
+
+static inline void init_uart_hardware() {
+    mini_uart_init_hardware();
+
+    *AUX_MINI_UART_INTERRUPT_ENABLE = INTERRUPTS_RECEIVE;
+}
+
+static inline bool uart_byte_waiting() {
+    return *AUX_MINI_UART_LINE_STATUS & LINE_STATUS_DATA_READY;
+}
+
+static inline uint8 uart_read_byte() {
+    return *AUX_MINI_UART_IO_DATA;
+}
+
+static inline uint32 uart_transmit_room() {
+    // Bits 24 - 27 of the extra status register are how many bytes the transmit FIFO has in it
+
+    return MINI_UART_FIFO_BYTES - ((*AUX_MINI_UART_EXTRA_STATS >> 24) & 0xF);
+}
+
+static inline void uart_write_byte(uint8 byte) {
+    *AUX_MINI_UART_IO_DATA = byte;
+}
+
+static inline void uart_transmit_interrupt(bool on) {
+    // This one fires for as long as the FIFO has room, so it must be off whenever there's nothing to send
+
+    *AUX_MINI_UART_INTERRUPT_ENABLE = on ? INTERRUPTS_RECEIVE_AND_TRANSMIT : INTERRUPTS_RECEIVE;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#include "types.h"
+#include "irq.h"
+
+#ifndef __pl011_h__
+#define	__pl011_h__
+
+// The PL011's side of uart.c, which includes this when built with PL011=1 (and mini_uart.h otherwise).
+// Only uart.c should include it. The setup is in pl011.S.
+
+#define PL011_DATA                      ((volatile uint32 *) 0x3F201000)
+#define PL011_FLAGS                     ((volatile uint32 *) 0x3F201018)
+#define PL011_INTERRUPT_MASK            ((volatile uint32 *) 0x3F201038)
+#define PL011_RAW_INTERRUPTS            ((volatile uint32 *) 0x3F20103C)
+
+#define PL011_FLAG_RECEIVE_EMPTY        (1 << 4)
+#define PL011_FLAG_TRANSMIT_FULL        (1 << 5)
+#define PL011_FLAG_TRANSMIT_EMPTY       (1 << 7)
+
+#define PL011_INTERRUPT_RECEIVE         (1 << 4)
+#define PL011_INTERRUPT_TRANSMIT        (1 << 5)                    // Set while the FIFO is at or below its level
+#define PL011_INTERRUPT_TIMEOUT         (1 << 6)                    // Bytes have sat in the receive FIFO a while
+
+#define PL011_FIFO_BYTES                16
+#define PL011_TRANSMIT_LEVEL_BYTES      4                           // The transmit interrupt level pl011.S sets
+
+#define UART_IRQ                        IRQ_PL011
+
+extern void pl011_init_hardware();
+
+static inline void init_uart_hardware() {
+    pl011_init_hardware();
+
+    *PL011_INTERRUPT_MASK = PL011_INTERRUPT_RECEIVE | PL011_INTERRUPT_TIMEOUT;
+}
+
+static inline bool uart_byte_waiting() {
+    return (*PL011_FLAGS & PL011_FLAG_RECEIVE_EMPTY) == 0;
+}
+
+static inline uint8 uart_read_byte() {
+    return *PL011_DATA;
+}
+
+static inline uint32 uart_transmit_room() {
+    // How many bytes we can write without checking the flags after each one. An empty FIFO takes all 16,
+    // and the transmit interrupt says it's down to its level. Otherwise all we know is whether it's full.
+
+    uint32 flags = *PL011_FLAGS;
+
+    if (flags & PL011_FLAG_TRANSMIT_EMPTY)
+        return PL011_FIFO_BYTES;
+
+    if (*PL011_RAW_INTERRUPTS & PL011_INTERRUPT_TRANSMIT)
+        return PL011_FIFO_BYTES - PL011_TRANSMIT_LEVEL_BYTES;
+
+    return (flags & PL011_FLAG_TRANSMIT_FULL) ? 0 : 1;
+}
+
+static inline void uart_write_byte(uint8 byte) {
+    *PL011_DATA = byte;
+}
+
+static inline void uart_transmit_interrupt(bool on) {
+    // Unlike the mini UART's, this interrupt only comes as the FIFO drains past its level, so turning it on
+    // does nothing by itself. uart.c fills the FIFO straight away after turning it on.
+
+    *PL011_INTERRUPT_MASK = PL011_INTERRUPT_RECEIVE | PL011_INTERRUPT_TIMEOUT |
+                            (on ? PL011_INTERRUPT_TRANSMIT : 0);
+}
+
+#endif
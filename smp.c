@@ -0,0 +1,88 @@
+#import "types.h"
+#import "smp.h"
+
+// Where the firmware's (and QEMU's) boot stub parks the secondary cores, it jumps to any non-zero address
+// written to the core's slot
+#define SPIN_TABLE                      0xD8
+
+core_data cores[CORE_COUNT];
+
+// What each core should run next, read by boot.S so the names matter. It's in .data, not .bss, since
+// parked cores can look at it before the main core has cleared the BSS.
+void (* volatile core_entries[CORE_COUNT])(void *) __attribute__((aligned(CACHE_LINE_BYTES), section(".data")));
+void * volatile core_arguments[CORE_COUNT] __attribute__((aligned(CACHE_LINE_BYTES)));
+
+extern void start_secondary_core();
+
+// Local functions
+
+static void clean_to_memory(volatile void *ptr) {
+    // Parked cores have their MMU and caches off, so push the cache line out to RAM where they can see it
+
+    asm volatile ("dc civac, %0" : : "r" (ptr) : "memory");
+}
+
+static void set_this_core(uint8 core) {
+    cores[core].core = core;
+
+    asm volatile ("msr tpidr_el1, %0" : : "r" (&cores[core]));
+}
+
+// Called from boot.S once a secondary core has its stack and MMU, never returns
+
+void secondary_core_main(uint8 core) {
+    set_this_core(core);
+
+    while (true) {
+        void (*entry)(void *) = core_entries[core];
+
+        if (entry == null) {
+            asm volatile ("wfe");
+            continue;
+        }
+
+        asm volatile ("dmb ish" : : : "memory");    // See the argument start_core() wrote before the entry
+
+        entry(core_arguments[core]);
+
+        asm volatile ("dmb ish" : : : "memory");    // Whatever entry() did is visible before we look idle
+
+        core_entries[core] = null;
+    }
+}
+
+// Exposed functions
+
+void init_smp() {
+    set_this_core(0);
+}
+
+bool start_core(uint8 core, void (*entry)(void *argument), void *argument) {
+    if (core == 0 || core >= CORE_COUNT || core_busy(core))
+        return false;
+
+    core_arguments[core] = argument;
+
+    asm volatile ("dmb ish" : : : "memory");        // The argument must be there before the entry is
+
+    core_entries[core] = entry;
+
+    // The first time a core starts it's either in stop_core (boot.S) or the firmware's spin table
+    // with its caches off, so both need to reach RAM. Pointing the spin table at us again is harmless.
+
+    volatile uint64 *spin_table = (volatile uint64 *) SPIN_TABLE;
+
+    spin_table[core] = (uint64) start_secondary_core;
+
+    clean_to_memory(&core_arguments[core]);
+    clean_to_memory(&core_entries[core]);
+    clean_to_memory(&spin_table[core]);
+
+    asm volatile ("dsb sy; sev" : : : "memory");    // Then wake everyone waiting in a WFE
+
+    return true;
+}
+
+bool core_busy(uint8 core) {
+    return core_entries[core] != null;
+}
@@ -0,0 +1,188 @@
+#include "types.h"
+
+#ifndef __smp_h__
+#define	__smp_h__
+
+#define CORE_COUNT                      4
+#define CACHE_LINE_BYTES                64
+
+// Each core's private state, one cache line (or more) each so the cores never fight over lines
+typedef struct __attribute__((aligned(CACHE_LINE_BYTES))) {
+    uint8 core;                         // Which core this is, 0 to 3
+    uint32 locks_held;                  // How many spinlocks this core holds right now
+    uint64 interrupts_before_locks;     // DAIF from before it took the first of them
+} core_data;
+
+// A simple spinning lock for the little bits of state the cores have to share, 0 when it's free
+typedef volatile uint32 spinlock;
+
+// Every core's data, indexed by core number, only touch your own outside of setup
+extern core_data cores[CORE_COUNT];
+
+// The data for the core we're running on, TPIDR_EL1 always points at it so no locking is needed
+static inline core_data *this_core() {
+    core_data *data;
+
+    asm volatile ("mrs %0, tpidr_el1" : "=r" (data));
+
+    return data;
+}
+
+// Waits until we hold the lock. IRQs stay masked on this core until it lets go of every lock it holds, so a
+// thread can't be switched out while holding one and leave another thread on this core spinning for it.
+// The exclusive loads and stores under this need the MMU on, without it the locks do nothing and only the
+// main core may touch shared state.
+static inline void acquire_lock(spinlock *lock) {
+    uint64 daif;
+
+    asm volatile ("mrs %0, daif\n\tmsr daifset, #2" : "=r" (daif) : : "memory");
+
+    core_data *core = this_core();
+
+    if (core->locks_held++ == 0)
+        core->interrupts_before_locks = daif;
+
+#ifndef NO_MMU
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        // Wait with reads so we aren't bouncing the cache line around while someone else holds it, and in
+        // WFE between them. The exclusive load arms the monitor, so the holder's store that frees the lock
+        // wakes us (the SEVL makes the first WFE fall straight through).
+
+        uint32 held;
+
+        asm volatile ("    sevl\n"
+                      "1:  wfe\n"
+                      "    ldxr    %w0, [%1]\n"
+                      "    cbnz    %w0, 1b"
+                      : "=&r" (held)
+                      : "r" (lock)
+                      : "memory");
+    }
+#endif
+}
+
+// Lets the next core take the lock, everything we wrote while holding it is visible first. IRQs go back to
+// how they were once this core holds no locks at all.
+static inline void release_lock(spinlock *lock) {
+#ifndef NO_MMU
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#endif
+
+    core_data *core = this_core();
+
+    if (--core->locks_held == 0)
+        asm volatile ("msr daif, %0" : : "r" (core->interrupts_before_locks) : "memory");
+}
+
+// Atomic double word operations, built from LDXR/STXR loops since the A53 has no LSE atomics. Each ends
+// with a full barrier so later loads can't be seen before the update is. Like the locks they need the MMU,
+// without it they're plain reads and writes for the main core only.
+
+// Sets the bits in *ptr, returning what was there before
+static inline uint64 atomic_set_bits(volatile uint64 *ptr, uint64 bits) {
+    uint64 old;
+
+#ifndef NO_MMU
+    uint64 updated;
+    uint32 failed;
+
+    asm volatile ("1:  ldxr    %0, [%3]\n"
+                  "    orr     %1, %0, %4\n"
+                  "    stlxr   %w2, %1, [%3]\n"
+                  "    cbnz    %w2, 1b\n"
+                  "    dmb     ish"
+                  : "=&r" (old), "=&r" (updated), "=&r" (failed)
+                  : "r" (ptr), "r" (bits)
+                  : "memory");
+#else
+    old = *ptr;
+    *ptr = old | bits;
+#endif
+
+    return old;
+}
+
+// Clears the bits in *ptr, returning what was there before
+static inline uint64 atomic_clear_bits(volatile uint64 *ptr, uint64 bits) {
+    uint64 old;
+
+#ifndef NO_MMU
+    uint64 updated;
+    uint32 failed;
+
+    asm volatile ("1:  ldxr    %0, [%3]\n"
+                  "    bic     %1, %0, %4\n"
+                  "    stlxr   %w2, %1, [%3]\n"
+                  "    cbnz    %w2, 1b\n"
+                  "    dmb     ish"
+                  : "=&r" (old), "=&r" (updated), "=&r" (failed)
+                  : "r" (ptr), "r" (bits)
+                  : "memory");
+#else
+    old = *ptr;
+    *ptr = old & ~bits;
+#endif
+
+    return old;
+}
+
+// Adds amount (which can be negative) to *ptr, returning what's there after
+static inline uint64 atomic_add(volatile uint64 *ptr, int64 amount) {
+    uint64 updated;
+
+#ifndef NO_MMU
+    uint32 failed;
+
+    asm volatile ("1:  ldxr    %0, [%2]\n"
+                  "    add     %0, %0, %3\n"
+                  "    stlxr   %w1, %0, [%2]\n"
+                  "    cbnz    %w1, 1b\n"
+                  "    dmb     ish"
+                  : "=&r" (updated), "=&r" (failed)
+                  : "r" (ptr), "r" (amount)
+                  : "memory");
+#else
+    updated = *ptr + amount;
+    *ptr = updated;
+#endif
+
+    return updated;
+}
+
+// Stores desired in *ptr only if it still holds expected, returns false if something else changed it first
+static inline bool atomic_compare_and_swap(volatile uint64 *ptr, uint64 expected, uint64 desired) {
+    uint64 old;
+
+#ifndef NO_MMU
+    uint32 failed;
+
+    asm volatile ("1:  ldxr    %0, [%2]\n"
+                  "    cmp     %0, %3\n"
+                  "    b.ne    2f\n"
+                  "    stlxr   %w1, %4, [%2]\n"
+                  "    cbnz    %w1, 1b\n"
+                  "    dmb     ish\n"
+                  "2:"
+                  : "=&r" (old), "=&r" (failed)
+                  : "r" (ptr), "r" (expected), "r" (desired)
+                  : "cc", "memory");
+#else
+    old = *ptr;
+
+    if (old == expected)
+        *ptr = desired;
+#endif
+
+    return old == expected;
+}
+
+// Sets up the main core's data, call before anything uses this_core()
+void init_smp();
+
+// Has the given (secondary) core run entry(argument) on its own stack, returns false if it's still busy
+bool start_core(uint8 core, void (*entry)(void *argument), void *argument);
+
+// True while the core is still running the last thing start_core() gave it
+bool core_busy(uint8 core);
+
+#endif
@@ -1,77 +1,97 @@
 #import "types.h"
 #import "memory.h"
+#import "arena.h"
+#import "convert.h"
+#import "string_ops.h"
 #import "uart.h"
+#import "smp.h"
+#import "idle.h"
+
+#define UART_PRINTF_BUFFER_BYTES    64                              // How much uart_printf() sends at a time
+
+// Where formatted output goes. The buffer is laid out like a string, so output starts past the size field.
+// When it fills up full() makes room: format_string() and append_format() grow the buffer, uart_printf() sends it.
+
+typedef struct formatter {
+    uint8 *buffer;                      // Where the output is going
+    uint16 index;                       // Where the next byte goes
+    uint16 size;                        // How big the buffer is
+    void (*full)(struct formatter *f);  // Makes room for at least one more byte
+    arena *scratch;                     // Where format_string()'s buffer lives
+    string_builder *builder;            // Where append_format()'s buffer lives
+} formatter;
+
+// A shared string is a reference count in front of an ordinary string. Holders point at the string, so
+// everything that reads strings works on it as is.
+
+typedef struct {
+    volatile uint64 references;         // How many holders there are, the block is freed when it gets to 0
+    string text;                        // The string itself, its bytes carry on past the end of the struct
+} shared_string;
 
 // Local functions
 
 static __attribute__((__noreturn__)) void panic_string_too_big() {
-    uart_send_string(string_from_cstring("Requested string too big"));
+    uart_send_string(LITERAL("Requested string too big"));
 
-    while (true) {};
+    halt();
 }
 
 static __attribute__((__noreturn__)) void panic_source_string_too_short() {
-    uart_send_string(string_from_cstring("Source string wasn't long enough"));
+    uart_send_string(LITERAL("Source string wasn't long enough"));
 
-    while (true) {};
+    halt();
 }
 
 static __attribute__((__noreturn__)) void panic_string_out_of_range() {
-    uart_send_string(string_from_cstring("Destination string wasn't big enough"));
+    uart_send_string(LITERAL("Destination string wasn't big enough"));
 
-    while (true) {};
+    halt();
 }
 
 static __attribute__((__noreturn__)) void panic_unexpected_character_in_number() {
-    uart_send_string(string_from_cstring("Unexpected character in number"));
+    uart_send_string(LITERAL("Unexpected character in number"));
 
-    while (true) {};
+    halt();
 }
 
 static __attribute__((__noreturn__)) void panic_negative_number_not_expected() {
-    uart_send_string(string_from_cstring("Negative number wasn't expected here"));
+    uart_send_string(LITERAL("Negative number wasn't expected here"));
 
-    while (true) {};
+    halt();
 }
 
-static void output_unsigned_integer(uint8 **buffer, uint64 number, uint16 * buffer_index, uint16 *buffer_size) {
-    // Let's count up how many digits we'll need
+static void output_char(formatter *f, uint8 c) {
+    if (f->index >= f->size)
+        f->full(f);
 
-    uint8 needed = 0;
-
-    for (uint64 working = number; working > 0; working = working / 10)
-        needed++;
+    f->buffer[f->index++] = c;
+}
 
-    if (needed == 0)
-        needed = 1;     // The number was 0, we still need to show the zero
+static void output_bytes(formatter *f, uint8 *bytes, uint16 length) {
+    // Copy across as much as fits each time, making room as needed
 
-    // Allocate a buffer we can use as a stack of digits
+    while (length > 0) {
+        if (f->index >= f->size)
+            f->full(f);
 
-    uint8 *stack = allocate(needed);
+        uint16 room = f->size - f->index;
+        uint16 chunk = length < room ? length : room;
 
-    uint64 working = number;
+        copy_memory((void *) bytes, (void *) &f->buffer[f->index], chunk);
 
-    for (uint8 i = 0; i < needed; i++) {
-        stack[i] = working % 10 + '0';
-        working = working / 10;
-    }
-
-    // Make sure that will fit in our destination
-
-    if (*buffer_index + needed >= *buffer_size) {
-        // Double the buffer size
-
-        *buffer_size = *buffer_size * 2;
-        reallocate((void **) buffer, *buffer_size);
+        f->index += chunk;
+        bytes += chunk;
+        length -= chunk;
     }
+}
 
-    // Now we can copy our digits into the buffer
+static void output_unsigned_integer(formatter *f, uint64 number) {
+    // 20 digits is enough for the biggest 64 bit number
 
-    for (uint8 i = needed; i > 0; i--) {
-        (*buffer)[(*buffer_index)++] = stack[i - 1];
-    }
+    uint8 digits[20];
 
-    free((void **) &stack);
+    output_bytes(f, digits, write_decimal(digits, number) - digits);
 }
 
 static uint8 bytes_to_display(uint64 number) {
@@ -92,74 +112,276 @@ static uint8 bytes_to_display(uint64 number) {
     }
 }
 
-static uint64 parse_hex(string *src, uint16 start, uint16 *next) {
-    uint64 number = 0;
-
-    for (uint16 next = start; next < src->size - 2; next++) {
-        char c = src->data[next];
+static bool is_letter(uint8 c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
 
-        if (c > 'F' && c <= 'Z')
-            panic_unexpected_character_in_number();     // No upper case
-        else if (c > 'f' && c <= 'z')
-            panic_unexpected_character_in_number();     // No lower case
-        else if (!((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (c >= '0' && c <= '9')))
-            break;                                      // Control or punctuation, so we're done
+static uint64 parse_hex(string *src, uint16 start, uint16 *next) {
+    uint16 used;
+    uint64 number = read_hex((uint8 *) &src->data + start, src->size - 2 - start, &used);
 
-        c &= 0xDF;              // Remove the lower case bit, if it was set
-        c -= '0';               // Turn it into 0-16 (with 10-16 being off due to ASCII
+    // Any letter past the hex digits is a mistake, control or punctuation just means we're done
 
-        if (c > 9)
-            c -= 7;             // Turn 'A' - '0' (17) into 10 so the hex digits are right
+    if (start + used < src->size - 2 && is_letter(((uint8 *) &src->data)[start + used]))
+        panic_unexpected_character_in_number();
 
-        number <<= 4;
-        number += c;
-    }
+    if (next != null)
+        *next = start + used;
 
     return number;
 }
 
 static uint64 parse_binary(string *src, uint16 start, uint16 *next) {
-    uint64 number = 0;
-
-    for (uint16 next = start; next < src->size - 2; next++) {
-        char c = src->data[next];
-
-        if (c >= 'A' && c <= 'Z')
-            panic_unexpected_character_in_number();     // No upper case
-        else if (c >= 'a' && c <= 'z')
-            panic_unexpected_character_in_number();     // No lower case
-        else if (c >= '2' && c <= '9')
-            panic_unexpected_character_in_number();     // No digits besides 0/1
-        else if (!(c == '0' || c == '1'))
-            break;                                      // Control or punctuation, so we're done
-
-        number <<= 1;
-        number += c - '0';
+    uint16 used;
+    uint64 number = read_binary((uint8 *) &src->data + start, src->size - 2 - start, &used);
+
+    // Letters and the other digits are mistakes, control or punctuation just means we're done
+
+    if (start + used < src->size - 2) {
+        uint8 c = ((uint8 *) &src->data)[start + used];
+
+        if (is_letter(c) || (c >= '2' && c <= '9'))
+            panic_unexpected_character_in_number();
     }
 
+    if (next != null)
+        *next = start + used;
+
     return number;
 }
 
 static uint64 parse_integer(string *src, uint16 start, uint16 *next) {
-    uint64 number = 0;
+    uint16 used;
+    uint64 number = read_decimal((uint8 *) &src->data + start, src->size - 2 - start, &used);
 
-    for (uint16 next = start; next < src->size - 2; next++) {
-        char c = src->data[next];
+    // Letters are mistakes, control or punctuation just means we're done
 
-        if (c >= 'A' && c <= 'Z')
-            panic_unexpected_character_in_number();     // No upper case
-        else if (c >= 'a' && c <= 'z')
-            panic_unexpected_character_in_number();     // No lower case
-        else if (!(c >= '0' || c <= '9'))
-            break;                                      // Control or punctuation, so we're done
+    if (start + used < src->size - 2 && is_letter(((uint8 *) &src->data)[start + used]))
+        panic_unexpected_character_in_number();
 
-        number *= 10;
-        number += c - '0';
-    }
+    if (next != null)
+        *next = start + used;
 
     return number;
 }
 
+static void grow_buffer(formatter *f) {
+    // Double the buffer, the arena can usually do that without copying. The last step stops at the biggest
+    // size a string can have, and needing more than that is a panic rather than a cut short string.
+
+    if (f->size == 0xFFFF)
+        panic_string_too_big();
+
+    uint32 size = (uint32) f->size * 2;
+
+    f->size = size > 0xFFFF ? 0xFFFF : size;
+    f->buffer = resize_in_arena(f->scratch, f->buffer, f->size, f->index);
+}
+
+static void make_room(string_builder *b, uint32 more) {
+    // Double the capacity (or more, if that's not enough) so appending N bytes copies O(N) bytes in total
+
+    uint32 needed = (uint32) b->text->size - 2 + more;
+
+    if (needed <= b->capacity)
+        return;
+
+    if (needed > 0xFFFF - 2)
+        panic_string_too_big();
+
+    uint32 capacity = (uint32) b->capacity * 2;
+
+    if (capacity < needed)
+        capacity = needed;
+
+    if (capacity > 0xFFFF - 2)
+        capacity = 0xFFFF - 2;
+
+    // Pages grow in place when they can, and the block we get may be bigger than we asked for, so use all of it
+
+    reallocate((void **) &b->text, capacity + 2, b->text->size);
+
+    uint64 block_size = memory_block_size(b->text);
+
+    b->capacity = block_size > 0xFFFF ? 0xFFFF - 2 : block_size - 2;
+}
+
+static void grow_builder(formatter *f) {
+    // The builder's string is the buffer, so grow it and carry on from where we were
+
+    f->builder->text->size = f->index;
+
+    make_room(f->builder, 1);
+
+    f->buffer = (uint8 *) f->builder->text;
+    f->size = f->builder->capacity + 2;
+}
+
+static shared_string *shared_block(string *s) {
+    return (shared_string *) ((uint64) s - __builtin_offsetof(shared_string, text));
+}
+
+static string *new_shared_string(uint16 length) {
+    if (length >= 0xFFFF - 2)
+        panic_string_too_big();
+
+    shared_string *block = allocate_uninitialized(__builtin_offsetof(shared_string, text) + 2 + length);
+
+    block->references = 1;
+    block->text.size = 2;
+
+    return &block->text;
+}
+
+static void flush_to_uart(formatter *f) {
+    // Send what we have as a string, then start filling again
+
+    ((string *) f->buffer)->size = f->index;
+
+    uart_send_string((string *) f->buffer);
+
+    f->index = 2;
+}
+
+static void format(uint8 *format, uint16 length, formatter *f, __builtin_va_list arguments) {
+    // Everything format_string() and uart_printf() support, see string.h
+
+    uint16 format_index = 0;
+
+    while (format_index < length) {
+        // See what character is next
+
+        if (format[format_index] != '%') {
+            // It's normal, copy straight across
+            output_char(f, format[format_index++]);
+        } else {
+            // We're doing a format string, so get the next character
+
+            format_index += 1;  // To eat up the % sign used for escaping format specifiers
+
+            uint8 specifier = format[format_index++];
+
+            if (specifier == '%') {
+                // Just an escaped percent sign, stick it in the buffer
+
+                output_char(f, '%');
+            } else if (specifier == 'c') {
+                // Just a character, it too goes straight in
+
+                int thing = __builtin_va_arg(arguments, int);
+
+                output_char(f, (char) thing);
+            } else if (specifier == 'u') {
+                // Integer, non-negative
+
+                uint64 number = __builtin_va_arg(arguments, uint64);
+
+                output_unsigned_integer(f, number);
+            } else if (specifier == 'd') {
+                // 32 bit integer, possibly-negative
+
+                int64 number = __builtin_va_arg(arguments, int32);
+
+                if (number < 0) {
+                    output_char(f, '-');
+                    number = 0 - number;
+                }
+
+                output_unsigned_integer(f, (uint64) number);
+            } else if (specifier == 'D') {
+                // 64 bit integer, possibly-negative
+
+                int64 number = __builtin_va_arg(arguments, int64);
+
+                if (number < 0) {
+                    output_char(f, '-');
+                    number = 0 - number;
+                }
+
+                output_unsigned_integer(f, (uint64) number);
+            } else if (specifier == 'x') {
+                uint64 number = __builtin_va_arg(arguments, uint64);
+                uint8 text[2 + 16] = {'0', 'x'};
+
+                output_bytes(f, text, write_hex(&text[2], number, bytes_to_display(number)) - text);
+            } else if (specifier == 'b') {
+                uint64 number = __builtin_va_arg(arguments, uint64);
+                uint8 text[2 + 64] = {'0', 'b'};
+
+                output_bytes(f, text, write_binary(&text[2], number, bytes_to_display(number)) - text);
+            } else if (specifier == 's') {
+                string *s = __builtin_va_arg(arguments, void *);
+
+                output_bytes(f, (uint8 *) &s->data, s->size - 2);
+            }
+        }
+    }
+}
+
+static uint16 argument_length(uint8 specifier, __builtin_va_list *arguments) {
+    // How many bytes the next argument will take, reading it the same way write_argument() will
+
+    if (specifier == 'c') {
+        __builtin_va_arg(*arguments, int);
+        return 1;
+    } else if (specifier == 'u') {
+        return decimal_length(__builtin_va_arg(*arguments, uint64));
+    } else if (specifier == 'd' || specifier == 'D') {
+        int64 number = specifier == 'd' ? __builtin_va_arg(*arguments, int32) : __builtin_va_arg(*arguments, int64);
+
+        return number < 0 ? 1 + decimal_length(0 - (uint64) number) : decimal_length(number);
+    } else if (specifier == 'x') {
+        return 2 + bytes_to_display(__builtin_va_arg(*arguments, uint64)) * 2;
+    } else if (specifier == 'b') {
+        return 2 + bytes_to_display(__builtin_va_arg(*arguments, uint64)) * 8;
+    } else if (specifier == 's') {
+        return ((string *) __builtin_va_arg(*arguments, void *))->size - 2;
+    }
+
+    return 0;
+}
+
+static uint8 *write_argument(uint8 *out, uint8 specifier, __builtin_va_list *arguments) {
+    // Writes the next argument at out, which has room for it, returning where the next thing goes
+
+    if (specifier == 'c') {
+        *out++ = (char) __builtin_va_arg(*arguments, int);
+    } else if (specifier == 'u') {
+        out = write_decimal(out, __builtin_va_arg(*arguments, uint64));
+    } else if (specifier == 'd' || specifier == 'D') {
+        int64 number = specifier == 'd' ? __builtin_va_arg(*arguments, int32) : __builtin_va_arg(*arguments, int64);
+
+        if (number < 0) {
+            *out++ = '-';
+            number = 0 - number;
+        }
+
+        out = write_decimal(out, (uint64) number);
+    } else if (specifier == 'x') {
+        uint64 number = __builtin_va_arg(*arguments, uint64);
+
+        *out++ = '0';
+        *out++ = 'x';
+
+        out = write_hex(out, number, bytes_to_display(number));
+    } else if (specifier == 'b') {
+        uint64 number = __builtin_va_arg(*arguments, uint64);
+
+        *out++ = '0';
+        *out++ = 'b';
+
+        out = write_binary(out, number, bytes_to_display(number));
+    } else if (specifier == 's') {
+        string *s = __builtin_va_arg(*arguments, void *);
+
+        copy_memory((void *) &s->data, (void *) out, s->size - 2);
+
+        out += s->size - 2;
+    }
+
+    return out;
+}
+
 // Functions
 
 string *empty_string(uint16 length) {
@@ -185,29 +407,22 @@ void expand_string(string **str, uint16 length) {
     if (length <= (*str)->size - 2)
         return;
 
-    // Reallocate memory (it knows if the block is big enough
+    // Reallocate memory (it knows if the block is big enough), keeping the current contents
 
-    reallocate((void **) str, length + 2);
+    reallocate((void **) str, length + 2, (*str)->size);
 }
 
 string *string_from_cstring(char data[]) {
-    // Figure out how long the C string is
-
-    uint32 size = 0;
+    // Figure out how long the C string is, size = length of string plus two to cover the size field
 
-    while (data[size] != 0x00)
-        size++;
-
-    // Size = length of string, add two to cover the size field in the string struct
-
-    size += 2;
+    uint64 size = cstring_length(data) + 2;
 
     // Ensure it will fit in our allocation budget
 
     if (size >= 0xFFFF)
         panic_string_too_big();
 
-    string *result = allocate(size);
+    string *result = allocate_uninitialized(size);
 
     result->size = size;
 
@@ -229,9 +444,9 @@ string *append_strings(string *one, string *two) {
     if (size >= 0x0000FFFF)
         panic_string_too_big();
 
-    // Allocate, setup, and copy
+    // Allocate, setup, and copy (every byte gets written, so there's no need to zero it)
 
-    string *result = allocate(size);
+    string *result = allocate_uninitialized(size);
 
     result->size = size;
 
@@ -243,15 +458,166 @@ string *append_strings(string *one, string *two) {
     return result;
 }
 
+bool strings_equal(string *one, string *two) {
+    return one->size == two->size && compare_bytes((uint8 *) &one->data, (uint8 *) &two->data, one->size - 2) == 0;
+}
+
+int16 compare_strings(string *one, string *two) {
+    // Compare as much as they both have, if that's the same the shorter one comes first
+
+    uint16 shorter = one->size < two->size ? one->size - 2 : two->size - 2;
+    int16 result = compare_bytes((uint8 *) &one->data, (uint8 *) &two->data, shorter);
+
+    return result != 0 ? result : (int16) (one->size > two->size) - (int16) (one->size < two->size);
+}
+
+int16 compare_strings_ignoring_case(string *one, string *two) {
+    uint16 shorter = one->size < two->size ? one->size - 2 : two->size - 2;
+    int16 result = compare_bytes_ignoring_case((uint8 *) &one->data, (uint8 *) &two->data, shorter);
+
+    return result != 0 ? result : (int16) (one->size > two->size) - (int16) (one->size < two->size);
+}
+
+int32 find_char(string *s, uint8 c, uint16 start) {
+    if (start >= s->size - 2)
+        return -1;
+
+    int32 found = find_byte((uint8 *) &s->data + start, s->size - 2 - start, c);
+
+    return found < 0 ? -1 : start + found;
+}
+
+int32 find_string(string *s, string *pattern, uint16 start) {
+    if (start > s->size - 2)
+        return -1;
+
+    uint8 *bytes = (uint8 *) &s->data + start;
+    int32 found = find_bytes(bytes, s->size - 2 - start, (uint8 *) &pattern->data, pattern->size - 2);
+
+    return found < 0 ? -1 : start + found;
+}
+
+string *empty_shared_string(uint16 length) {
+    return new_shared_string(length);
+}
+
+string *share_string(string *s) {
+    string *result = new_shared_string(s->size - 2);
+
+    result->size = s->size;
+
+    copy_memory((void *) &s->data, (void *) &result->data, s->size - 2);
+
+    return result;
+}
+
+string *retain_string(string *s) {
+    atomic_add(&shared_block(s)->references, 1);
+
+    return s;
+}
+
+void release_string(string **s) {
+    shared_string *block = shared_block(*s);
+
+    // Whoever takes the count to 0 is the last holder, nobody else can be looking at it any more
+
+    if (atomic_add(&block->references, -1) == 0)
+        free((void **) &block);
+
+    *s = null;
+}
+
+void make_string_writable(string **s, uint16 length) {
+    shared_string *block = shared_block(*s);
+
+    // With one reference it's ours alone, so it only needs copying if it's too small. Nobody else can add
+    // a reference while we're the only holder, so the count can't change under us.
+
+    if (block->references == 1 &&
+        memory_block_size(block) >= __builtin_offsetof(shared_string, text) + 2 + (uint64) length)
+        return;
+
+    string *copy = new_shared_string(length > (*s)->size - 2 ? length : (*s)->size - 2);
+
+    copy->size = (*s)->size;
+
+    copy_memory((void *) &(*s)->data, (void *) &copy->data, (*s)->size - 2);
+
+    release_string(s);
+
+    *s = copy;
+}
+
+string_builder start_builder(uint16 capacity) {
+    string_builder b = {.text = allocate_uninitialized((uint64) capacity + 2)};
+
+    b.text->size = 2;
+    b.capacity = memory_block_size(b.text) > 0xFFFF ? 0xFFFF - 2 : memory_block_size(b.text) - 2;
+
+    return b;
+}
+
+void append_bytes(string_builder *b, uint8 *bytes, uint16 length) {
+    make_room(b, length);
+
+    copy_memory((void *) bytes, (void *) ((uint64) &b->text->data + b->text->size - 2), length);
+
+    b->text->size += length;
+}
+
+void append_string(string_builder *b, string *s) {
+    append_bytes(b, (uint8 *) &s->data, s->size - 2);
+}
+
+void append_char(string_builder *b, uint8 c) {
+    make_room(b, 1);
+
+    ((uint8 *) &b->text->data)[b->text->size - 2] = c;
+    b->text->size++;
+}
+
+void append_format(string_builder *b, string *format_string, ...) {
+    // Format straight onto the end of the builder's string, growing it as we go
+
+    formatter f = {
+        .buffer = (uint8 *) b->text,
+        .index = b->text->size,
+        .size = b->capacity + 2,
+        .full = grow_builder,
+        .builder = b
+    };
+
+    __builtin_va_list arguments;
+    __builtin_va_start(arguments, format_string);
+
+    format((uint8 *) &format_string->data, format_string->size - 2, &f, arguments);
+
+    __builtin_va_end(arguments);
+
+    b->text->size = f.index;
+}
+
+string *finish_builder(string_builder *b) {
+    // The builder's string is already a string, it just might have room to spare (free() doesn't mind)
+
+    string *result = b->text;
+
+    b->text = null;
+    b->capacity = 0;
+
+    return result;
+}
+
 string *substring(string *src, uint16 start, uint16 length) {
     // Ensure it will fit in our allocation budget
 
     if (length >= 0xFFFF - 2)
         panic_string_too_big();
 
-    // Allocate it and copy the requested data in
+    // Allocate it and copy the requested data in (every byte gets written, so there's no need to zero it)
 
-    string *result = empty_string(length + 2);
+    string *result = allocate_uninitialized(length + 2);
 
     result->size = length + 2;
 
@@ -272,169 +638,196 @@ void copy_string(string *src, uint16 src_start, uint16 length, string *dest, uin
 }
 
 string *format_string(string *format_string, ...) {
+    // Work in a buffer from this thread's scratch arena, only the finished string is really allocated.
+    // We'll start with our minimum allocate size for simplicity. It becomes a string, so reserve space
+    // for the size field.
+
+    arena *scratch = scratch_arena();
+    arena_mark mark = mark_arena(scratch);
+
+    formatter f = {
+        .buffer = allocate_from_arena(scratch, MINIMUM_ALLOCATION_BYTES),
+        .index = 2,
+        .size = MINIMUM_ALLOCATION_BYTES,
+        .full = grow_buffer,
+        .scratch = scratch
+    };
+
     __builtin_va_list arguments;
     __builtin_va_start(arguments, format_string);
 
-    // Setup a buffer we can work in. We'll start with our minimum allocate size for simplicity.
+    format((uint8 *) &format_string->data, format_string->size - 2, &f, arguments);
 
-    uint16 buffer_size = MINIMUM_ALLOCATION_BYTES;
-    uint16 buffer_index = 2;                // Buffer will become a string, reserve space for the size field
+    __builtin_va_end(arguments);
 
-    // Make working with out place in the format easy
+    // We're done, copy the buffer into a string of just the right size and give the scratch space back
 
-    uint8 *format = (uint8 *) &format_string->data;
-    uint16 format_index = 0;
+    string *result = allocate_uninitialized(f.index);
 
-    // The buffer we're working in
+    ((string *) f.buffer)->size = f.index;
 
-    uint8 *buffer = allocate(buffer_size);
+    copy_memory(f.buffer, result, f.index);
 
-    while(format_index < format_string->size - 2) {
-        // Ensure the buffer is big enough
+    reset_arena(scratch, mark);
 
-        if (buffer_index + 1 >= buffer_size) {
-            // Double the buffer size
+    return result;
+}
 
-            buffer_size = buffer_size * 2;
-            reallocate((void **) &buffer, buffer_size);
-        }
+void uart_printf(string *format_string, ...) {
+    // Format into a small buffer on the stack, sending it whenever it fills up
 
-        // See what character is next
+    uint8 buffer[UART_PRINTF_BUFFER_BYTES];
 
-        if (format[format_index] != '%') {
-            // It's normal, copy straight across
-            buffer[buffer_index++] = format[format_index++];
-        } else {
-            // We're doing a format string, so get the next character
+    formatter f = {
+        .buffer = buffer,
+        .index = 2,
+        .size = sizeof(buffer),
+        .full = flush_to_uart
+    };
 
-            format_index += 1;  // To eat up the % sign used for escaping format specifiers
+    __builtin_va_list arguments;
+    __builtin_va_start(arguments, format_string);
 
-            uint8 specifier = format[format_index++];
+    format((uint8 *) &format_string->data, format_string->size - 2, &f, arguments);
 
-            if (specifier == '%') {
-                // Just an escaped percent sign, stick it in the buffer
+    __builtin_va_end(arguments);
 
-                buffer[buffer_index++] = '%';
-            } else if (specifier == 'c') {
-                // Just a character, it too goes straight in
+    if (f.index > 2)
+        flush_to_uart(&f);
+}
 
-                int thing = __builtin_va_arg(arguments, int);
+compiled_format *compile_format(string *format) {
+    // First count the ops and literal bytes so we can allocate it all as one block
 
-                buffer[buffer_index++] = (char) thing;
-            } else if (specifier == 'u') {
-                // Integer, non-negative
+    uint8 *characters = (uint8 *) &format->data;
+    uint16 length = format->size - 2;
+    uint16 op_count = 0;
+    uint16 literal_bytes = 0;
+    bool in_literal = false;
 
-                uint64 number = __builtin_va_arg(arguments, uint64);
+    for (uint16 i = 0; i < length; i++) {
+        bool literal = characters[i] != '%' || (i + 1 < length && characters[i + 1] == '%');
 
-                output_unsigned_integer(&buffer, number, &buffer_index, &buffer_size);
-            } else if (specifier == 'd') {
-                // 32 bit integer, possibly-negative
+        if (characters[i] == '%')
+            i++;            // Skip the specifier, or the second % of an escaped one
 
-                int64 number = __builtin_va_arg(arguments, int32);
+        if (literal) {
+            op_count += in_literal ? 0 : 1;
+            literal_bytes++;
+        } else {
+            op_count++;
+        }
 
-                if (number < 0) {
-                    buffer[buffer_index++] = '-';
-                    number = 0 - number;
-                }
+        in_literal = literal;
+    }
 
-                output_unsigned_integer(&buffer, (uint64) number, &buffer_index, &buffer_size);
-            } else if (specifier == 'D') {
-                // 64 bit integer, possibly-negative
+    compiled_format *compiled = allocate_uninitialized(sizeof(compiled_format) + op_count * sizeof(format_op) + literal_bytes);
 
-                int64 number = __builtin_va_arg(arguments, int64);
+    compiled->op_count = op_count;
+    compiled->literal_bytes = literal_bytes;
+    compiled->ops = (format_op *) (compiled + 1);
+    compiled->literals = (uint8 *) (compiled->ops + op_count);
 
-                if (number < 0) {
-                    buffer[buffer_index++] = '-';
-                    number = 0 - number;
-                }
+    // Now fill them in, runs of literal characters (and escaped percent signs) become one span
 
-                output_unsigned_integer(&buffer, (uint64) number, &buffer_index, &buffer_size);
-            } else if (specifier == 'x') {
-                uint64 number = __builtin_va_arg(arguments, uint64);
-                uint8 bytes = bytes_to_display(number);
+    format_op *op = compiled->ops - 1;
+    uint8 *literal = compiled->literals;
 
-                uint8 chars = 2 + bytes * 2;     // Two characters for 0x, two for each byte (one per nibble)
+    in_literal = false;
 
-                if (buffer_index + chars > buffer_size) {
-                    // Double the buffer size
-                    buffer_size = buffer_size * 2;
-                    reallocate((void **) &buffer, buffer_size);
-                }
+    for (uint16 i = 0; i < length; i++) {
+        bool literal_character = characters[i] != '%' || (i + 1 < length && characters[i + 1] == '%');
+        uint8 c = characters[i];
 
-                buffer[buffer_index++] = '0';
-                buffer[buffer_index++] = 'x';
+        if (characters[i] == '%')
+            c = i + 1 < length ? characters[++i] : 0;
 
-                // Convert each byte in order, high to low
-                for (int b = bytes - 1; b >= 0; b--) {
-                    uint8 byte = (uint8) (number >> 8 * b);     // Get the byte we care about
-                    uint8 highNibble = byte >> 4;
-                    uint8 lowNibble = byte & 0x0F;
-                    buffer[buffer_index++] = highNibble + '0' + (highNibble > 9 ? 7 : 0);   // 7 adjusts '9' + 1 -> 'A'
-                    buffer[buffer_index++] = lowNibble + '0' + (lowNibble > 9 ? 7 : 0);
-                }
-            } else if (specifier == 'b') {
-                uint64 number = __builtin_va_arg(arguments, uint64);
-                uint8 bytes = bytes_to_display(number);
+        if (literal_character) {
+            if (!in_literal) {
+                op++;
+                op->specifier = FORMAT_LITERAL;
+                op->length = 0;
+            }
 
-                uint8 chars = 2 + bytes * 8;    // Two characters for 0b, one for each bit
+            *literal++ = c;
+            op->length++;
+        } else {
+            op++;
+            op->specifier = c;
+            op->length = 0;
+        }
 
-                if (buffer_index + chars > buffer_size) {
-                    // Double the buffer size
-                    buffer_size = buffer_size * 2;
-                    reallocate((void **) &buffer, buffer_size);
-                }
+        in_literal = literal_character;
+    }
 
-                buffer[buffer_index++] = '0';
-                buffer[buffer_index++] = 'b';
+    return compiled;
+}
 
-                // Convert each byte in order, high to low
-                for (int b = bytes - 1; b >= 0; b--) {
-                    uint8 byte = (uint8) (number >> 8 * b);     // Get the byte we care about
+string *render_format(compiled_format *compiled, ...) {
+    __builtin_va_list arguments;
+    __builtin_va_list measuring;
 
-                    for (int bit = 7; bit >= 0; bit--)
-                        buffer[buffer_index++] = ((byte & (1 << bit)) >> bit) + '0';
-                }
-            } else if (specifier == 's') {
-                 string *s = __builtin_va_arg(arguments, void *);
+    __builtin_va_start(arguments, compiled);
+    __builtin_va_copy(measuring, arguments);
 
-                 while (s->size - 2 + buffer_index > buffer_size) {
-                    // Double the buffer size until it's big enough (while loop in case the string is HUGE)
-                    buffer_size = buffer_size * 2;
-                    reallocate((void **) &buffer, buffer_size);
-                 }
+    // Work out exactly how big the result is first
 
-                 copy_string(s, 0, s->size - 2, (string *) buffer, buffer_index - 2);
+    uint32 size = 2 + compiled->literal_bytes;
 
-                 buffer_index += s->size - 2;
-            }
-        }
+    for (uint16 i = 0; i < compiled->op_count; i++) {
+        if (compiled->ops[i].specifier != FORMAT_LITERAL)
+            size += argument_length(compiled->ops[i].specifier, &measuring);
     }
 
-    // We're done, return the now correct buffer
+    __builtin_va_end(measuring);
 
-    __builtin_va_end(arguments);
+    if (size >= 0xFFFF)
+        panic_string_too_big();
+
+    // Then write everything straight into the string, literals are bulk copied
+
+    string *result = allocate_uninitialized(size);
+    uint8 *out = (uint8 *) &result->data;
+    uint8 *literal = compiled->literals;
+
+    result->size = size;
 
-    ((string *) buffer)->size = buffer_index;
+    for (uint16 i = 0; i < compiled->op_count; i++) {
+        format_op *op = &compiled->ops[i];
 
-    return (string *) buffer;
+        if (op->specifier == FORMAT_LITERAL) {
+            copy_memory((void *) literal, (void *) out, op->length);
+
+            literal += op->length;
+            out += op->length;
+        } else {
+            out = write_argument(out, op->specifier, &arguments);
+        }
+    }
+
+    __builtin_va_end(arguments);
+
+    return result;
 }
 
 // Parse a signed number (binary, hex, or integer)
 uint64 parse_number(string *src, uint16 start, bool *negative, uint16 *next) {
+    uint8 *text = (uint8 *) &src->data;
+
     if (negative != null)
         *negative = false;
 
     if (src->size - 2 > start + 2 &&
-        src->data[start] == '0' &&
-        src->data[start + 1] == 'x') {
+        text[start] == '0' &&
+        text[start + 1] == 'x') {
 
         return parse_hex(src, start + 2, next);
     } else if (src->size - 2 > start + 2 &&
-               src->data[start] == '0' &&
-               src->data[start + 1] == 'b') {
+               text[start] == '0' &&
+               text[start + 1] == 'b') {
         return parse_binary(src, start + 2, next);
     } else {
-        bool hasMinus = src->data[start] == '-';
+        bool hasMinus = text[start] == '-';
 
         if (negative == null && hasMinus) {
             panic_negative_number_not_expected();
@@ -11,6 +11,22 @@ typedef struct __attribute__((__packed__)) {
 	uint8* data;
 } string;
 
+// A string literal built by the compiler, size field and all, and put in .rodata with the other literals (see
+// link.ld). Nothing is scanned, copied or allocated at runtime, so it's safe anywhere, even in a panic.
+// Don't write to it or free() it. Only actual literals work, LITERAL(some_pointer) won't compile. It's 8 byte
+// aligned like an allocated string, the struct is packed so nothing else would stop size landing on an odd
+// address, and with NO_MMU=1 reading it from there faults.
+
+#define LITERAL(text) ({                                                                    \
+    _Static_assert(sizeof("" text) + 1 <= 0xFFFF, "Literal too big for a string");          \
+    static const struct __attribute__((__packed__)) {                                       \
+        uint16 size;                                                                        \
+        char data[sizeof(text) - 1];                                                        \
+    } literal __attribute__((section(".rodata.literals"), aligned(8)))                      \
+        = {sizeof(text) + 1, text};                                                         \
+    (string *) &literal;                                                                    \
+})
+
 // Reserve an empty string guaranteed to be able to hold length UTF-8 bytes
 string *empty_string(uint16 length);
 
@@ -20,10 +36,72 @@ void expand_string(string **str, uint16 length);
 // Creates a string from a C style string that we may get from an external source
 string *string_from_cstring(char data[]);
 
-// Returns a new string that is a concatenation of the two passed in
+// Returns a new string that is a concatenation of the two passed in (use a string_builder for more than two)
 string *append_strings(string *one, string *two);
 
+// True if both strings hold the same bytes
+bool strings_equal(string *one, string *two);
+
+// Orders strings by their bytes, returns < 0 if one comes first, 0 if they're the same, > 0 if two comes first
+int16 compare_strings(string *one, string *two);
+
+// Orders strings like compare_strings() but with A-Z treated as a-z
+int16 compare_strings_ignoring_case(string *one, string *two);
+
+// Where the first c at or after start is in the string, -1 if there isn't one
+int32 find_char(string *s, uint8 c, uint16 start);
+
+// Where the first copy of pattern at or after start begins in the string, -1 if there isn't one
+int32 find_string(string *s, string *pattern, uint16 start);
+
+// Shared strings have a reference count, so handing one to someone else is just retain_string(), not a copy.
+// They work anywhere a string is read, but each holder gives theirs up with release_string() rather than
+// free(), and the last one to do so frees it. Change one only after make_string_writable().
+
+// Reserve an empty shared string guaranteed to be able to hold length UTF-8 bytes, with one reference
+string *empty_shared_string(uint16 length);
+
+// Copies a string into a new shared string with one reference
+string *share_string(string *s);
+
+// Adds a reference to a shared string for a new holder, returns the string
+string *retain_string(string *s);
+
+// Gives up a reference to a shared string and nulls out the pointer, freeing the string if it was the last one
+void release_string(string **s);
+
+// Makes sure we're the only holder of a shared string and it can hold length UTF-8 bytes, so it's safe to
+// change. If anyone else holds it (or it's too small) we get our own copy, and give up our reference to theirs.
+void make_string_writable(string **s, uint16 length);
+
+// A string_builder builds a string a piece at a time. It keeps track of how much room its string has
+// past the used size, and grows it geometrically, so N appends copy O(N) bytes rather than O(N²).
+
+typedef struct {
+    string *text;                       // What's been built so far, its size covers only what's used
+    uint16 capacity;                    // How many bytes text can hold without growing
+} string_builder;
+
+// Starts building a string with room for capacity bytes before it has to grow
+string_builder start_builder(uint16 capacity);
+
+// Appends length bytes to the string being built
+void append_bytes(string_builder *b, uint8 *bytes, uint16 length);
+
+// Appends a string to the string being built
+void append_string(string_builder *b, string *s);
+
+// Appends one character to the string being built
+void append_char(string_builder *b, uint8 c);
+
+// Formats onto the end of the string being built, with the same specifiers as format_string()
+void append_format(string_builder *b, string *format, ...);
+
+// Hands back the built string, no copy is made. The builder is done with after this, free() the string.
+string *finish_builder(string_builder *b);
+
 // Returns a new string that is a substring starting at position start made up of length bytes
+// (slice_view() in view.h gets at the same bytes without allocating or copying)
 string *substring(string *src, uint16 start, uint16 length);
 
 // Copies selected bytes from one string to the other starting at the given destination position
@@ -46,4 +124,31 @@ uint64 parse_number(string *src, uint16 start, bool *negative, uint16 *next);
 //              b - binary, any size
 string *format_string(string *format, ...);
 
+// A format string compiled by compile_format(): a list of literal spans and argument slots, with the
+// literal bytes copied in after the ops so it doesn't need the original format. It's one block, free() it.
+
+#define FORMAT_LITERAL                  0
+
+typedef struct {
+    uint8 specifier;                    // FORMAT_LITERAL or the specifier character of an argument slot
+    uint16 length;                      // How many literal bytes, 0 for argument slots
+} format_op;
+
+typedef struct {
+    uint16 op_count;                    // How many ops there are
+    uint16 literal_bytes;               // How many literal bytes there are in total
+    format_op *ops;                     // The ops, in order
+    uint8 *literals;                    // Every literal span, one after the other
+} compiled_format;
+
+// Parses a format string once so render_format() doesn't have to, supports the same specifiers as format_string()
+compiled_format *compile_format(string *format);
+
+// Creates a new string from a compiled format and arguments, with one allocation of exactly the right size
+string *render_format(compiled_format *compiled, ...);
+
+// Formats like format_string() but sends the result straight out of the UART, a piece at a time.
+// It uses no heap at all, so with a LITERAL() format it's safe when memory isn't (like in a panic).
+void uart_printf(string *format, ...);
+
 #endif
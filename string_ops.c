@@ -0,0 +1,166 @@
+#import "types.h"
+#import "string_ops.h"
+#import "swar.h"
+
+// Each kernel loads 8 bytes at a time with the helpers in swar.h and turns the bytes it's looking for into set
+// high bits, so the lowest set bit says which byte came first.
+
+// Local functions
+
+static uint64 lower_case(uint64 eight) {
+    // Bytes from A to Z, leaving out any with the high bit set (they'd look like they were in range),
+    // then set the 0x20 bit on just those
+
+    uint64 upper = bytes_at_least(eight, 'A') & ~bytes_at_least(eight, 'Z' + 1) & ~eight;
+
+    return eight | (upper >> 2);
+}
+
+static uint8 lower_case_byte(uint8 c) {
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static int16 compare_bytes_from(uint8 *one, uint8 *two, uint16 index, uint16 length) {
+    for (; index < length; index++)
+        if (one[index] != two[index])
+            return (int16) one[index] - (int16) two[index];
+
+    return 0;
+}
+
+// Functions
+
+uint64 cstring_length(char *text) {
+    uint8 *bytes = (uint8 *) text;
+    uint64 index = 0;
+
+    // A byte at a time until we're aligned, after that reading a little past the 0 can't cross into
+    // another page, since a page is a whole number of double words
+
+    for (; ((uint64) &bytes[index] & 7) != 0; index++)
+        if (bytes[index] == 0)
+            return index;
+
+    while (true) {
+        uint64 zeros = zero_bytes(load_eight(&bytes[index]));
+
+        if (zeros != 0)
+            return index + first_byte(zeros);
+
+        index += 8;
+    }
+}
+
+int16 compare_bytes(uint8 *one, uint8 *two, uint16 length) {
+    uint16 index = 0;
+
+#ifdef NO_MMU
+    // Loads have to be aligned, if one and two can't be aligned together there's nothing for it but bytes
+
+    if ((((uint64) one ^ (uint64) two) & 7) != 0)
+        return compare_bytes_from(one, two, 0, length);
+
+    for (; index < length && ((uint64) &one[index] & 7) != 0; index++)
+        if (one[index] != two[index])
+            return (int16) one[index] - (int16) two[index];
+#endif
+
+    for (; index + 8 <= length; index += 8) {
+        uint64 different = load_eight(&one[index]) ^ load_eight(&two[index]);
+
+        if (different != 0) {
+            index += first_byte(different);
+
+            return (int16) one[index] - (int16) two[index];
+        }
+    }
+
+    return compare_bytes_from(one, two, index, length);
+}
+
+int16 compare_bytes_ignoring_case(uint8 *one, uint8 *two, uint16 length) {
+    uint16 index = 0;
+
+    // Unaligned loads are built from bytes when the MMU is off, so there's no need to line anything up here
+
+    for (; index + 8 <= length; index += 8) {
+        uint64 different = lower_case(load_eight(&one[index])) ^ lower_case(load_eight(&two[index]));
+
+        if (different != 0) {
+            index += first_byte(different);
+            break;
+        }
+    }
+
+    for (; index < length; index++) {
+        uint8 c1 = lower_case_byte(one[index]);
+        uint8 c2 = lower_case_byte(two[index]);
+
+        if (c1 != c2)
+            return (int16) c1 - (int16) c2;
+    }
+
+    return 0;
+}
+
+int32 find_byte(uint8 *bytes, uint16 length, uint8 c) {
+    uint16 index = 0;
+
+    // A byte at a time until we're aligned, then 8 at a time looking for bytes that XOR with c to 0
+
+    for (; index < length && ((uint64) &bytes[index] & 7) != 0; index++)
+        if (bytes[index] == c)
+            return index;
+
+    for (; index + 8 <= length; index += 8) {
+        uint64 matches = zero_bytes(load_eight(&bytes[index]) ^ EVERY_BYTE(c));
+
+        if (matches != 0)
+            return index + first_byte(matches);
+    }
+
+    for (; index < length; index++)
+        if (bytes[index] == c)
+            return index;
+
+    return -1;
+}
+
+int32 find_bytes(uint8 *bytes, uint16 length, uint8 *pattern, uint16 pattern_length) {
+    if (pattern_length == 0)
+        return 0;
+
+    if (pattern_length > length)
+        return -1;
+
+    if (pattern_length == 1)
+        return find_byte(bytes, length, pattern[0]);
+
+    // Look at 8 starting places at once. Only those where both the first and last byte of the pattern
+    // match are worth comparing in full, which rules out nearly all of them in ordinary text.
+
+    uint64 first = EVERY_BYTE(pattern[0]);
+    uint64 last = EVERY_BYTE(pattern[pattern_length - 1]);
+    uint16 last_start = length - pattern_length;
+    uint32 index = 0;
+
+    for (; index + 7 <= last_start; index += 8) {
+        uint64 candidates = zero_bytes(load_eight(&bytes[index]) ^ first) &
+                            zero_bytes(load_eight(&bytes[index + pattern_length - 1]) ^ last);
+
+        while (candidates != 0) {
+            uint32 start = index + first_byte(candidates);
+
+            if (compare_bytes(&bytes[start + 1], &pattern[1], pattern_length - 2) == 0)
+                return start;
+
+            candidates &= candidates - 1;
+        }
+    }
+
+    for (; index <= last_start; index++)
+        if (bytes[index] == pattern[0] && compare_bytes(&bytes[index], pattern, pattern_length) == 0)
+            return index;
+
+    return -1;
+}
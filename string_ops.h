@@ -0,0 +1,25 @@
+#include "types.h"
+
+#ifndef __string_ops_h__
+#define	__string_ops_h__
+
+// Search and compare kernels for the string code. They look at 8 bytes at a time by loading them as one double
+// word and finding the interesting bytes with a few integer operations, rather than going a byte at a time.
+// Lengths are the string code's uint16, searches return -1 if nothing was found.
+
+// How long a C string is, not counting the terminating 0
+uint64 cstring_length(char *text);
+
+// Compares length bytes, returns 0 if they're the same or the difference between the first bytes that aren't
+int16 compare_bytes(uint8 *one, uint8 *two, uint16 length);
+
+// Like compare_bytes() but A-Z are treated as a-z, any other byte (including UTF-8) has to match exactly
+int16 compare_bytes_ignoring_case(uint8 *one, uint8 *two, uint16 length);
+
+// Where the first c is in the bytes
+int32 find_byte(uint8 *bytes, uint16 length, uint8 c);
+
+// Where the first copy of the pattern starts in the bytes, an empty pattern is found at 0
+int32 find_bytes(uint8 *bytes, uint16 length, uint8 *pattern, uint16 pattern_length);
+
+#endif
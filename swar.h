@@ -0,0 +1,73 @@
+#include "types.h"
+
+#ifndef __swar_h__
+#define	__swar_h__
+
+// Helpers for working on 8 bytes at a time in one double word (SWAR, SIMD within a register), shared by the
+// conversion and string search kernels. A double word is loaded little endian, so the first byte is the low
+// byte. Results come back as the high bit of each byte, and the lowest set bit is the first byte.
+
+#define EVERY_BYTE(value)           (0x0101010101010101ULL * (value))
+#define HIGH_BITS                   EVERY_BYTE(0x80)
+#define LOW_BITS                    EVERY_BYTE(0x7F)
+
+static inline uint64 load_eight(uint8 *bytes) {
+#ifdef NO_MMU
+    // With the MMU off everything is device memory, where loads have to be aligned, so build it from bytes
+
+    if (((uint64) bytes & 7) != 0) {
+        uint64 eight = 0;
+
+        for (int8 i = 7; i >= 0; i--)
+            eight = (eight << 8) | bytes[i];
+
+        return eight;
+    }
+#endif
+
+    // The compiler turns this into a single (possibly unaligned) load
+
+    uint64 eight;
+
+    __builtin_memcpy(&eight, bytes, 8);
+
+    return eight;
+}
+
+static inline void store_eight(uint8 *bytes, uint64 eight) {
+#ifdef NO_MMU
+    // Stores to device memory have to be aligned too, so go a byte at a time, lowest first
+
+    if (((uint64) bytes & 7) != 0) {
+        for (uint8 i = 0; i < 8; i++, eight >>= 8)
+            bytes[i] = eight & 0xFF;
+
+        return;
+    }
+#endif
+
+    // The compiler turns this into a single (possibly unaligned) store
+
+    __builtin_memcpy(bytes, &eight, 8);
+}
+
+static inline uint64 bytes_at_least(uint64 eight, uint8 value) {
+    // The high bit of each byte is set if that byte is >= value, for bytes below 0x80. Setting each
+    // byte's high bit first means the subtract can never borrow from the next byte.
+
+    return ((eight | HIGH_BITS) - EVERY_BYTE(value)) & HIGH_BITS;
+}
+
+static inline uint64 zero_bytes(uint64 eight) {
+    // The high bit of each byte is set if the byte is 0. Adding 0x7F to the low seven bits of a byte sets
+    // its high bit if any of them are set and can't carry into the next byte, unlike the usual x - 0x01 trick
+    // which can flag a 0x01 just above a real zero (fine for the first zero, but not for every match).
+
+    return ~(((eight & LOW_BITS) + LOW_BITS) | eight | LOW_BITS);
+}
+
+static inline uint8 first_byte(uint64 high_bits) {
+    return __builtin_ctzll(high_bits) / 8;
+}
+
+#endif
@@ -0,0 +1,279 @@
+#import "../types.h"
+#import <stdio.h>
+#import <stdlib.h>
+#import <pthread.h>
+
+// We're going to hammer a copy of the lock-free block claim and release from the memory code with four
+// threads, one per core on the Pi. Every thread claims and releases random blocks, marking each block it
+// holds as its own, so any block handed out twice is caught. At the end every block must be free and the
+// index must agree with the bitmap. The builtins stand in for CLZ/CLS and the LDXR/STXR loops.
+
+#define THREADS                     4
+#define OPERATIONS                  2000000
+#define HELD_BLOCKS                 512                             // How many blocks each thread holds at most
+
+typedef struct {
+    volatile uint64 *bitmap;
+    volatile uint64 *summary;
+    volatile uint64 top;
+    uint32 blocks;
+} pool;
+
+static pool test_pool;
+static volatile uint8 *owners;                                     // Which thread holds each block, 0 if none
+
+uint8 find_first_unset_bit_from_left(uint64 double_word) {
+    return ~double_word == 0 ? 64 : __builtin_clzll(~double_word);
+}
+
+uint8 find_first_set_bit_from_left(uint64 double_word) {
+    return double_word == 0 ? 64 : __builtin_clzll(double_word);
+}
+
+uint64 bit_from_left(uint8 bit) {
+    return 0x8000000000000000 >> bit;
+}
+
+uint64 atomic_set_bits(volatile uint64 *ptr, uint64 bits) {
+    return __atomic_fetch_or(ptr, bits, __ATOMIC_SEQ_CST);
+}
+
+uint64 atomic_clear_bits(volatile uint64 *ptr, uint64 bits) {
+    return __atomic_fetch_and(ptr, ~bits, __ATOMIC_SEQ_CST);
+}
+
+bool atomic_compare_and_swap(volatile uint64 *ptr, uint64 expected, uint64 desired) {
+    return __atomic_compare_exchange_n(ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+void init_pool(pool *p, uint32 blocks) {
+    uint32 double_words = (blocks + 63) / 64;
+    uint32 summary_double_words = (double_words + 63) / 64;
+
+    p->bitmap = calloc(double_words, 8);
+    p->summary = calloc(summary_double_words, 8);
+    p->blocks = blocks;
+
+    for (uint32 i = 0; i < summary_double_words; i++)
+        p->summary[i] = ~0ULL;
+
+    if (double_words % 64 != 0)
+        p->summary[summary_double_words - 1] = ~(~0ULL >> (double_words % 64));
+
+    p->top = ~(~0ULL >> 1 >> (summary_double_words - 1));
+
+    if (blocks % 64 != 0)
+        p->bitmap[double_words - 1] = ~0ULL >> (blocks % 64);
+}
+
+void clear_top_hint(pool *p, uint8 summary_double_word) {
+    atomic_clear_bits(&p->top, bit_from_left(summary_double_word));
+
+    if (p->summary[summary_double_word] != 0)
+        atomic_set_bits(&p->top, bit_from_left(summary_double_word));
+}
+
+void clear_summary_hint(pool *p, uint32 double_word) {
+    uint8 summary_double_word = double_word / 64;
+    uint64 summary_bit = bit_from_left(double_word % 64);
+
+    uint64 summary = atomic_clear_bits(&p->summary[summary_double_word], summary_bit) & ~summary_bit;
+
+    if (p->bitmap[double_word] != ~0ULL) {
+        atomic_set_bits(&p->summary[summary_double_word], summary_bit);
+        atomic_set_bits(&p->top, bit_from_left(summary_double_word));
+    } else if (summary == 0) {
+        clear_top_hint(p, summary_double_word);
+    }
+}
+
+int64 claim_block(pool *p) {
+    while (true) {
+        uint64 top = p->top;
+
+        if (top == 0)
+            return -1;
+
+        uint8 summary_double_word = find_first_set_bit_from_left(top);
+        uint64 summary = p->summary[summary_double_word];
+
+        if (summary == 0) {
+            clear_top_hint(p, summary_double_word);
+            continue;
+        }
+
+        uint32 double_word_with_clear_bit = summary_double_word * 64 + find_first_set_bit_from_left(summary);
+        uint64 double_word = p->bitmap[double_word_with_clear_bit];
+        uint8 clear_bit_from_left = find_first_unset_bit_from_left(double_word);
+
+        if (clear_bit_from_left == 64) {
+            clear_summary_hint(p, double_word_with_clear_bit);
+            continue;
+        }
+
+        uint64 claimed = double_word | bit_from_left(clear_bit_from_left);
+
+        if (!atomic_compare_and_swap(&p->bitmap[double_word_with_clear_bit], double_word, claimed))
+            continue;
+
+        if (claimed == ~0ULL)
+            clear_summary_hint(p, double_word_with_clear_bit);
+
+        return 64 * double_word_with_clear_bit + clear_bit_from_left;
+    }
+}
+
+void release_block(pool *p, uint32 block) {
+    uint32 double_word_with_bit = block / 64;
+    uint32 summary_double_word = double_word_with_bit / 64;
+    uint64 summary_bit = bit_from_left(double_word_with_bit % 64);
+
+    atomic_clear_bits(&p->bitmap[double_word_with_bit], bit_from_left(block % 64));
+
+    if ((p->summary[summary_double_word] & summary_bit) == 0)
+        atomic_set_bits(&p->summary[summary_double_word], summary_bit);
+
+    if ((p->top & bit_from_left(summary_double_word)) == 0)
+        atomic_set_bits(&p->top, bit_from_left(summary_double_word));
+}
+
+// Test helpers
+
+static volatile uint64 double_handouts = 0;
+static volatile uint64 failed_claims = 0;
+
+void take(uint8 thread, uint32 block) {
+    uint8 expected = 0;
+
+    if (!__atomic_compare_exchange_n(&owners[block], &expected, thread, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        printf("Block %u handed to thread %u while thread %u held it\n", block, thread, expected);
+        __atomic_fetch_add(&double_handouts, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void give_back(uint8 thread, uint32 block) {
+    uint8 expected = thread;
+
+    if (!__atomic_compare_exchange_n(&owners[block], &expected, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        printf("Block %u released by thread %u but held by thread %u\n", block, thread, expected);
+        __atomic_fetch_add(&double_handouts, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void *hammer(void *argument) {
+    uint8 thread = (uint8) (uint64) argument;
+    uint32 held[HELD_BLOCKS];
+    uint32 count = 0;
+    uint32 seed = thread;
+
+    for (uint32 i = 0; i < OPERATIONS; i++) {
+        // Lean towards claiming until we hold a lot, then towards releasing
+
+        bool claiming = count == 0 || (count < HELD_BLOCKS && rand_r(&seed) % HELD_BLOCKS >= count);
+
+        if (claiming) {
+            int64 block = claim_block(&test_pool);
+
+            if (block < 0) {
+                __atomic_fetch_add(&failed_claims, 1, __ATOMIC_SEQ_CST);
+                continue;
+            }
+
+            take(thread, block);
+            held[count++] = block;
+        } else {
+            uint32 which = rand_r(&seed) % count;
+            uint32 block = held[which];
+
+            held[which] = held[--count];
+
+            give_back(thread, block);
+            release_block(&test_pool, block);
+        }
+    }
+
+    while (count > 0) {
+        give_back(thread, held[--count]);
+        release_block(&test_pool, held[count]);
+    }
+
+    return null;
+}
+
+bool index_matches_bitmap(pool *p) {
+    // With nothing in flight every double word with space must have its summary bit, and so on up
+
+    uint32 double_words = (p->blocks + 63) / 64;
+
+    for (uint32 i = 0; i < double_words; i++) {
+        bool has_space = p->bitmap[i] != ~0ULL;
+        bool summary_says = (p->summary[i / 64] & bit_from_left(i % 64)) != 0;
+
+        if (has_space && !summary_says)
+            return false;
+
+        if (has_space && (p->top & bit_from_left(i / 64)) == 0)
+            return false;
+    }
+
+    return true;
+}
+
+void test_concurrent_claims(uint32 blocks) {
+    // Fewer blocks than the threads want to hold means the pool keeps running full, which is the hard case
+
+    init_pool(&test_pool, blocks);
+    owners = calloc(blocks, 1);
+    double_handouts = 0;
+    failed_claims = 0;
+
+    pthread_t threads[THREADS];
+
+    for (uint64 i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], null, hammer, (void *) (i + 1));
+
+    for (uint8 i = 0; i < THREADS; i++)
+        pthread_join(threads[i], null);
+
+    uint32 still_used = 0;
+
+    for (uint32 i = 0; i < blocks; i++)
+        still_used += (test_pool.bitmap[i / 64] & bit_from_left(i % 64)) != 0;
+
+    printf("%6u blocks: %llu double handouts, %u still marked used, %llu claims found it full, index %s\n",
+           blocks, double_handouts, still_used, failed_claims,
+           index_matches_bitmap(&test_pool) ? "matches" : "DOES NOT MATCH");
+
+    if (double_handouts != 0 || still_used != 0 || !index_matches_bitmap(&test_pool))
+        exit(1);
+
+    // Now every block should come back out exactly once
+
+    for (uint32 i = 0; i < blocks; i++) {
+        if (claim_block(&test_pool) < 0) {
+            printf("Only %u of %u blocks could be claimed after the threads finished\n", i, blocks);
+            exit(1);
+        }
+    }
+
+    if (claim_block(&test_pool) >= 0) {
+        printf("Claimed more than %u blocks\n", blocks);
+        exit(1);
+    }
+
+    free((void *) test_pool.bitmap);
+    free((void *) test_pool.summary);
+    free((void *) owners);
+}
+
+int main() {
+    printf("%d threads, %d operations each\n\n", THREADS, OPERATIONS);
+
+    test_concurrent_claims(1000);
+    test_concurrent_claims(2048);
+    test_concurrent_claims(100000);
+
+    printf("\nNo block was ever handed out twice\n");
+
+    return 0;
+}
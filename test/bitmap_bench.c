@@ -0,0 +1,239 @@
+#import "../types.h"
+#import <stdio.h>
+#import <stdlib.h>
+#import <time.h>
+
+// We're going to benchmark a copy of the block search from the memory code, comparing the old linear scan
+// of the bitmap with the two level index (top -> summary -> bitmap). The builtins stand in for CLZ/CLS
+// so this runs on any host.
+
+#define MAXIMUM_BLOCKS              (64 * 64 * 64)
+#define OPERATIONS                  1000000
+
+typedef struct {
+    uint64 bitmap[MAXIMUM_BLOCKS / 64];     // A set bit indicates the block is in use
+    uint64 summary[MAXIMUM_BLOCKS / 4096];  // A set bit indicates that bitmap double word has a free block
+    uint64 top;                             // A set bit indicates that summary double word has a set bit
+    uint32 blocks;
+    uint32 double_words;
+    uint32 first_bit;                       // Hint used by the linear scan, where free space was last seen
+} pool;
+
+static pool test_pool;
+
+uint8 find_first_unset_bit_from_left(uint64 double_word) {
+    return ~double_word == 0 ? 64 : __builtin_clzll(~double_word);
+}
+
+uint8 find_first_set_bit_from_left(uint64 double_word) {
+    return double_word == 0 ? 64 : __builtin_clzll(double_word);
+}
+
+uint64 bit_from_left(uint8 bit) {
+    return 0x8000000000000000 >> bit;
+}
+
+__attribute__((__noreturn__)) void panic_out_of_memory() {
+    printf("\n\nUnable to allocate\n\n");
+    exit(1);
+}
+
+// The old search, a scan from the hint
+
+uint32 linear_allocate(pool *p) {
+    for (uint32 i = p->first_bit; i < p->double_words; i++) {
+        uint8 clear_bit = find_first_unset_bit_from_left(p->bitmap[i]);
+
+        if (clear_bit != 64) {
+            p->bitmap[i] |= bit_from_left(clear_bit);
+            p->first_bit = i;
+
+            return i * 64 + clear_bit;
+        }
+    }
+
+    panic_out_of_memory();
+}
+
+void linear_free(pool *p, uint32 block) {
+    if (block / 64 < p->first_bit)
+        p->first_bit = block / 64;
+
+    p->bitmap[block / 64] &= ~bit_from_left(block % 64);
+}
+
+// The new search, walking down the index
+
+uint32 indexed_allocate(pool *p) {
+    if (p->top == 0)
+        panic_out_of_memory();
+
+    uint8 summary_double_word = find_first_set_bit_from_left(p->top);
+    uint8 summary_bit = find_first_set_bit_from_left(p->summary[summary_double_word]);
+    uint32 double_word = summary_double_word * 64 + summary_bit;
+    uint8 clear_bit = find_first_unset_bit_from_left(p->bitmap[double_word]);
+
+    p->bitmap[double_word] |= bit_from_left(clear_bit);
+
+    if (p->bitmap[double_word] == ~0ULL) {
+        p->summary[summary_double_word] &= ~bit_from_left(summary_bit);
+
+        if (p->summary[summary_double_word] == 0)
+            p->top &= ~bit_from_left(summary_double_word);
+    }
+
+    return double_word * 64 + clear_bit;
+}
+
+void indexed_free(pool *p, uint32 block) {
+    uint32 double_word = block / 64;
+
+    p->bitmap[double_word] &= ~bit_from_left(block % 64);
+    p->summary[double_word / 64] |= bit_from_left(double_word % 64);
+    p->top |= bit_from_left(double_word / 64);
+}
+
+// Setup
+
+void reset_pool(pool *p, uint32 blocks) {
+    p->blocks = blocks;
+    p->double_words = blocks / 64;
+    p->first_bit = 0;
+    p->top = 0;
+
+    for (uint32 i = 0; i < MAXIMUM_BLOCKS / 64; i++)
+        p->bitmap[i] = 0;
+
+    for (uint32 i = 0; i < MAXIMUM_BLOCKS / 4096; i++)
+        p->summary[i] = 0;
+
+    for (uint32 i = 0; i < p->double_words; i++) {
+        p->summary[i / 64] |= bit_from_left(i % 64);
+        p->top |= bit_from_left(i / 64);
+    }
+}
+
+// Randomly marks blocks used until we hit the requested occupancy, remembering them so we can free some later
+
+uint32 fill_pool(pool *p, uint32 percent, uint32 *used, bool indexed) {
+    uint32 target = (uint64) p->blocks * percent / 100;
+    uint32 count = 0;
+
+    while (count < target) {
+        uint32 block = rand() % p->blocks;
+
+        if (p->bitmap[block / 64] & bit_from_left(block % 64))
+            continue;
+
+        p->bitmap[block / 64] |= bit_from_left(block % 64);
+        used[count++] = block;
+    }
+
+    // Rebuild the index from the bitmap
+
+    if (indexed) {
+        for (uint32 i = 0; i < p->double_words; i++) {
+            if (p->bitmap[i] == ~0ULL)
+                p->summary[i / 64] &= ~bit_from_left(i % 64);
+        }
+
+        for (uint32 i = 0; i < (p->double_words + 63) / 64; i++) {
+            if (p->summary[i] == 0)
+                p->top &= ~bit_from_left(i);
+        }
+    }
+
+    return count;
+}
+
+double now() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// Keeps occupancy steady by allocating one block then freeing a random used one, returns ns per pair
+
+double run(uint32 blocks, uint32 percent, bool indexed) {
+    static uint32 used[MAXIMUM_BLOCKS];
+
+    srand(1234);
+
+    reset_pool(&test_pool, blocks);
+
+    uint32 count = fill_pool(&test_pool, percent, used, indexed);
+
+    if (count == 0)
+        used[count++] = indexed ? indexed_allocate(&test_pool) : linear_allocate(&test_pool);
+
+    double start = now();
+
+    for (uint32 i = 0; i < OPERATIONS; i++) {
+        uint32 slot = rand() % count;
+        uint32 block = indexed ? indexed_allocate(&test_pool) : linear_allocate(&test_pool);
+
+        if (indexed)
+            indexed_free(&test_pool, used[slot]);
+        else
+            linear_free(&test_pool, used[slot]);
+
+        used[slot] = block;
+    }
+
+    return (now() - start) / OPERATIONS;
+}
+
+// Make sure the index never hands out a block twice and finds every block
+
+void test_index_hands_out_every_block() {
+    printf("\nTesting the index hands out each block once... ");
+
+    reset_pool(&test_pool, 4096 + 128);
+
+    for (uint32 i = 0; i < test_pool.blocks; i++) {
+        uint32 block = indexed_allocate(&test_pool);
+
+        if (block != i) {
+            printf("\nBUG, expected block %u but got %u\n", i, block);
+            exit(1);
+        }
+    }
+
+    if (test_pool.top != 0) {
+        printf("\nBUG, pool is full but the top says there is space\n");
+        exit(1);
+    }
+
+    indexed_free(&test_pool, 4100);
+    indexed_free(&test_pool, 7);
+
+    if (indexed_allocate(&test_pool) != 7 || indexed_allocate(&test_pool) != 4100) {
+        printf("\nBUG, freed blocks weren't found again\n");
+        exit(1);
+    }
+
+    printf("OK\n");
+}
+
+int main() {
+    test_index_hands_out_every_block();
+
+    uint32 sizes[] = {1024, 16384, MAXIMUM_BLOCKS};
+    uint32 occupancies[] = {0, 50, 95, 99};
+
+    printf("\nns per allocate + free pair, %u operations each\n\n", OPERATIONS);
+    printf("%8s %10s %10s %10s\n", "Blocks", "Occupancy", "Linear", "Indexed");
+
+    for (int s = 0; s < 3; s++) {
+        for (int o = 0; o < 4; o++) {
+            double linear = run(sizes[s], occupancies[o], false);
+            double indexed = run(sizes[s], occupancies[o], true);
+
+            printf("%8u %9u%% %10.1f %10.1f\n", sizes[s], occupancies[o], linear, indexed);
+        }
+    }
+
+    printf("\n");
+}
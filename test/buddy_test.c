@@ -0,0 +1,464 @@
+#import "../types.h"
+#import <stdio.h>
+#import <stdlib.h>
+#import <time.h>
+
+// We're going to stress a copy of the page (buddy) allocator from the memory code. It hands out random
+// sized blocks, checks no two blocks ever overlap, frees everything and checks it all coalesced back.
+// It also checks blocks grow into their free buddies and shrink in place the way reallocate() uses them.
+
+#define PAGE_SIZE                   4096
+#define PAGE_SHIFT                  12
+#define MAXIMUM_PAGE_ORDER          14
+
+#define PAGE_FREE                   0x80
+#define PAGE_NOT_HEAD               0xFF
+
+#define AMOUNT_TO_ALLOCATE          (1ULL << 30)                    // A gig, it's only touched as it's used
+#define LIVE_BLOCKS                 4096
+#define OPERATIONS                  2000000
+
+typedef struct free_page_block {
+    struct free_page_block *next;
+    struct free_page_block *previous;
+} free_page_block;
+
+free_page_block *free_page_lists[MAXIMUM_PAGE_ORDER + 1];
+
+uint8 *page_orders;
+void *pages_start;
+void *pages_end;
+uint64 page_count;
+
+uint16 *owner = null;                                               // Which live block owns each page
+
+__attribute__((__noreturn__)) void panic_out_of_memory(uint64 size) {
+    printf("\n\nUnable to allocate %llu bytes\n\n", size);
+    exit(1);
+}
+
+__attribute__((__noreturn__)) void panic_bad_pointer(void *ptr) {
+    printf("\n\n\nAsked to free bad pointer: %p\n\n", ptr);
+    exit(1);
+}
+
+uint8 page_order_for(uint64 size) {
+    if (size <= PAGE_SIZE)
+        return 0;
+
+    return 64 - __builtin_clzll(size - 1) - PAGE_SHIFT;
+}
+
+void push_free_page_block(uint64 page, uint8 order) {
+    free_page_block *block = pages_start + (page << PAGE_SHIFT);
+
+    block->previous = null;
+    block->next = free_page_lists[order];
+
+    if (block->next != null)
+        block->next->previous = block;
+
+    free_page_lists[order] = block;
+    page_orders[page] = PAGE_FREE | order;
+}
+
+void remove_free_page_block(uint64 page, uint8 order) {
+    free_page_block *block = pages_start + (page << PAGE_SHIFT);
+
+    if (block->previous != null)
+        block->previous->next = block->next;
+    else
+        free_page_lists[order] = block->next;
+
+    if (block->next != null)
+        block->next->previous = block->previous;
+}
+
+void init_pages(void *start, void *end) {
+    uint64 available = end > start ? (uint64) (end - start) : 0;
+
+    page_count = available > PAGE_SIZE ? (available - PAGE_SIZE) / (PAGE_SIZE + 1) : 0;
+    page_orders = start;
+
+    pages_start = (void *) (((uint64) start + page_count + PAGE_SIZE - 1) & ~((uint64) PAGE_SIZE - 1));
+    pages_end = pages_start + (page_count << PAGE_SHIFT);
+
+    for (uint64 i = 0; i < page_count; i++)
+        page_orders[i] = PAGE_NOT_HEAD;
+
+    for (uint8 i = 0; i <= MAXIMUM_PAGE_ORDER; i++)
+        free_page_lists[i] = null;
+
+    uint64 page = 0;
+
+    while (page < page_count) {
+        uint8 order = MAXIMUM_PAGE_ORDER;
+
+        while ((page & ((1ULL << order) - 1)) != 0 || page + (1ULL << order) > page_count)
+            order--;
+
+        push_free_page_block(page, order);
+
+        page += 1ULL << order;
+    }
+}
+
+void *allocate_pages(uint64 size) {
+    uint8 order = page_order_for(size);
+
+    if (order > MAXIMUM_PAGE_ORDER)
+        panic_out_of_memory(size);
+
+    uint8 found = order;
+
+    while (found <= MAXIMUM_PAGE_ORDER && free_page_lists[found] == null)
+        found++;
+
+    if (found > MAXIMUM_PAGE_ORDER)
+        panic_out_of_memory(size);
+
+    uint64 page = (uint64) ((void *) free_page_lists[found] - pages_start) >> PAGE_SHIFT;
+
+    remove_free_page_block(page, found);
+
+    while (found > order) {
+        found--;
+
+        push_free_page_block(page + (1ULL << found), found);
+    }
+
+    page_orders[page] = order;
+
+    return pages_start + (page << PAGE_SHIFT);
+}
+
+void free_pages(void **ptr) {
+    if (*ptr == null)
+        return;
+
+    if (*ptr < pages_start || *ptr >= pages_end || ((uint64) *ptr & (PAGE_SIZE - 1)) != 0)
+        panic_bad_pointer(*ptr);
+
+    uint64 page = (uint64) (*ptr - pages_start) >> PAGE_SHIFT;
+    uint8 order = page_orders[page];
+
+    if (order > MAXIMUM_PAGE_ORDER)
+        panic_bad_pointer(*ptr);
+
+    while (order < MAXIMUM_PAGE_ORDER) {
+        uint64 buddy = page ^ (1ULL << order);
+
+        if (buddy + (1ULL << order) > page_count || page_orders[buddy] != (PAGE_FREE | order))
+            break;
+
+        remove_free_page_block(buddy, order);
+
+        if (buddy > page) {
+            page_orders[buddy] = PAGE_NOT_HEAD;
+        } else {
+            page_orders[page] = PAGE_NOT_HEAD;
+            page = buddy;
+        }
+
+        order++;
+    }
+
+    push_free_page_block(page, order);
+
+    *ptr = null;
+}
+
+bool resize_pages_in_place(void *ptr, uint64 size) {
+    uint8 wanted = page_order_for(size);
+
+    if (wanted > MAXIMUM_PAGE_ORDER)
+        panic_out_of_memory(size);
+
+    uint64 page = (uint64) (ptr - pages_start) >> PAGE_SHIFT;
+    uint8 order = page_orders[page];
+
+    if (order > MAXIMUM_PAGE_ORDER)
+        panic_bad_pointer(ptr);
+
+    while (order > wanted) {
+        order--;
+
+        push_free_page_block(page + (1ULL << order), order);
+    }
+
+    bool fits = true;
+
+    for (uint8 i = order; i < wanted && fits; i++) {
+        uint64 buddy = page + (1ULL << i);
+
+        fits = (page & ((2ULL << i) - 1)) == 0 && buddy + (1ULL << i) <= page_count &&
+                    page_orders[buddy] == (PAGE_FREE | i);
+    }
+
+    if (fits) {
+        for (; order < wanted; order++) {
+            uint64 buddy = page + (1ULL << order);
+
+            remove_free_page_block(buddy, order);
+
+            page_orders[buddy] = PAGE_NOT_HEAD;
+        }
+    }
+
+    page_orders[page] = order;
+
+    return fits;
+}
+
+//////
+
+uint64 count_free_blocks(uint8 order) {
+    uint64 count = 0;
+
+    for (free_page_block *block = free_page_lists[order]; block != null; block = block->next)
+        count++;
+
+    return count;
+}
+
+// Random sizes, mostly small with the odd big one, like a kernel would ask for
+
+uint64 random_size() {
+    uint32 r = rand() % 100;
+
+    if (r < 70)
+        return 1 + rand() % (4 * PAGE_SIZE);
+    else if (r < 95)
+        return 1 + rand() % (256 * PAGE_SIZE);
+    else
+        return 1 + rand() % (4096ULL * PAGE_SIZE);
+}
+
+void claim(uint16 id, void *block) {
+    uint64 page = (uint64) (block - pages_start) >> PAGE_SHIFT;
+
+    for (uint64 i = 0; i < 1ULL << page_orders[page]; i++) {
+        if (owner[page + i] != 0) {
+            printf("\nBUG, page %llu handed to %u but %u already has it\n", page + i, id, owner[page + i]);
+            exit(1);
+        }
+
+        owner[page + i] = id;
+    }
+}
+
+void release(void *block) {
+    uint64 page = (uint64) (block - pages_start) >> PAGE_SHIFT;
+
+    for (uint64 i = 0; i < 1ULL << page_orders[page]; i++)
+        owner[page + i] = 0;
+}
+
+void test_no_overlaps_and_full_coalescing() {
+    static void *live[LIVE_BLOCKS];
+    uint64 initial[MAXIMUM_PAGE_ORDER + 1];
+
+    printf("\nTesting random allocations never overlap and everything coalesces... ");
+
+    for (uint8 i = 0; i <= MAXIMUM_PAGE_ORDER; i++)
+        initial[i] = count_free_blocks(i);
+
+    srand(42);
+
+    for (uint32 i = 0; i < 200000; i++) {
+        uint32 slot = rand() % (LIVE_BLOCKS / 4);
+
+        if (live[slot] != null) {
+            release(live[slot]);
+            free_pages(&live[slot]);
+        } else {
+            live[slot] = allocate_pages(random_size());
+            claim(slot + 1, live[slot]);
+        }
+    }
+
+    for (uint32 i = 0; i < LIVE_BLOCKS; i++) {
+        if (live[i] != null) {
+            release(live[i]);
+            free_pages(&live[i]);
+        }
+    }
+
+    for (uint8 i = 0; i <= MAXIMUM_PAGE_ORDER; i++) {
+        if (count_free_blocks(i) != initial[i]) {
+            printf("\nBUG, order %u has %llu free blocks, expected %llu\n", i, count_free_blocks(i), initial[i]);
+            exit(1);
+        }
+    }
+
+    printf("OK\n");
+}
+
+void test_split_and_merge(void *memory) {
+    printf("\nTesting a single page splits the biggest block and merges back... ");
+
+    // Just enough memory for exactly one block of the biggest order
+
+    init_pages(memory, memory + (PAGE_SIZE + 1) * (1ULL << MAXIMUM_PAGE_ORDER) + PAGE_SIZE);
+
+    void *one = allocate_pages(1);
+    void *two = allocate_pages(PAGE_SIZE);
+
+    if (two != one + PAGE_SIZE) {
+        printf("\nBUG, expected the buddy %p, got %p\n", one + PAGE_SIZE, two);
+        exit(1);
+    }
+
+    void *big = allocate_pages(PAGE_SIZE * 3);
+
+    if (big != one + PAGE_SIZE * 4 || page_orders[4] != 2) {
+        printf("\nBUG, expected a 4 page block at %p, got %p\n", one + PAGE_SIZE * 4, big);
+        exit(1);
+    }
+
+    free_pages(&one);
+    free_pages(&big);
+    free_pages(&two);
+
+    if (page_orders[0] != (PAGE_FREE | MAXIMUM_PAGE_ORDER)) {
+        printf("\nBUG, block 0 didn't merge back, order byte is 0x%X\n", page_orders[0]);
+        exit(1);
+    }
+
+    printf("OK\n");
+}
+
+void test_resize_in_place(void *memory) {
+    printf("\nTesting blocks grow into free buddies and shrink in place... ");
+
+    init_pages(memory, memory + (PAGE_SIZE + 1) * (1ULL << MAXIMUM_PAGE_ORDER) + PAGE_SIZE);
+
+    // A page at the very start can double all the way up while everything above it is free
+
+    void *block = allocate_pages(1);
+
+    for (uint8 order = 1; order <= 6; order++) {
+        if (!resize_pages_in_place(block, PAGE_SIZE << order) || page_orders[0] != order) {
+            printf("\nBUG, couldn't grow to order %u in place\n", order);
+            exit(1);
+        }
+    }
+
+    // Something in the way stops it growing, and nothing changes
+
+    void *neighbour = allocate_pages(PAGE_SIZE << 6);
+
+    if (neighbour != block + (PAGE_SIZE << 6)) {
+        printf("\nBUG, expected the neighbour at %p, got %p\n", block + (PAGE_SIZE << 6), neighbour);
+        exit(1);
+    }
+
+    if (resize_pages_in_place(block, PAGE_SIZE << 7) || page_orders[0] != 6) {
+        printf("\nBUG, grew over a block that's in use\n");
+        exit(1);
+    }
+
+    // The upper half of a block can never grow in place, its buddy is below it
+
+    if (resize_pages_in_place(neighbour, PAGE_SIZE << 7)) {
+        printf("\nBUG, an upper half grew in place\n");
+        exit(1);
+    }
+
+    // Shrinking gives the upper halves back, they're handed out again straight away
+
+    if (!resize_pages_in_place(block, PAGE_SIZE) || page_orders[0] != 0 || page_orders[1] != (PAGE_FREE | 0)) {
+        printf("\nBUG, didn't shrink in place\n");
+        exit(1);
+    }
+
+    void *next = allocate_pages(PAGE_SIZE);
+
+    if (next != block + PAGE_SIZE) {
+        printf("\nBUG, expected the freed half at %p, got %p\n", block + PAGE_SIZE, next);
+        exit(1);
+    }
+
+    free_pages(&next);
+    free_pages(&neighbour);
+    free_pages(&block);
+
+    if (page_orders[0] != (PAGE_FREE | MAXIMUM_PAGE_ORDER)) {
+        printf("\nBUG, block 0 didn't merge back, order byte is 0x%X\n", page_orders[0]);
+        exit(1);
+    }
+
+    printf("OK\n");
+}
+
+double now() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void benchmark(uint8 largest_order) {
+    static void *live[LIVE_BLOCKS];
+    static uint64 sizes[OPERATIONS];
+
+    srand(7);
+
+    for (uint32 i = 0; i < OPERATIONS; i++)
+        sizes[i] = 1 + rand() % (PAGE_SIZE << largest_order);
+
+    uint32 slot = 0;
+    double start = now();
+
+    for (uint32 i = 0; i < OPERATIONS; i++) {
+        slot = (slot + 2654435761U) % LIVE_BLOCKS;
+
+        if (live[slot] != null)
+            free_pages(&live[slot]);
+        else
+            live[slot] = allocate_pages(sizes[i]);
+    }
+
+    double elapsed = now() - start;
+
+    for (uint32 i = 0; i < LIVE_BLOCKS; i++)
+        free_pages(&live[i]);
+
+    printf("%12llu %14.1f %14.0f\n", (uint64) PAGE_SIZE << largest_order, elapsed / OPERATIONS,
+                                        OPERATIONS / elapsed * 1e9);
+}
+
+int main() {
+    printf("Getting memory\n");
+
+    void *from_malloc = malloc(AMOUNT_TO_ALLOCATE);
+
+    if (from_malloc == null) {
+        printf("Can't get memory\n");
+        exit(1);
+    }
+
+    test_split_and_merge(from_malloc);
+    test_resize_in_place(from_malloc);
+
+    init_pages(from_malloc, from_malloc + AMOUNT_TO_ALLOCATE);
+
+    owner = calloc(page_count, sizeof(uint16));
+
+    printf("\n%llu pages\n", page_count);
+
+    test_no_overlaps_and_full_coalescing();
+
+    printf("\nAllocate/free throughput, %u operations with %u live blocks\n\n", OPERATIONS, LIVE_BLOCKS);
+    printf("%12s %14s %14s\n", "Largest", "ns per op", "ops per sec");
+
+    benchmark(0);
+    benchmark(4);
+    benchmark(6);
+
+    printf("\n");
+
+    free(owner);
+    free(from_malloc);
+}
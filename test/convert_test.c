@@ -0,0 +1,320 @@
+#import "../types.h"
+#import <stdio.h>
+#import <stdlib.h>
+#import <string.h>
+#import <time.h>
+
+// The conversion kernels are plain C, so we test the real thing rather than a copy. Random numbers go through
+// each writer and reader and are checked against the C library, including readers stopping on bad characters
+// at every position. Then the kernels are timed against the one digit at a time code they replaced.
+
+#import "../convert.c"
+
+#define FUZZ_ROUNDS                 2000000
+#define BENCHMARK_NUMBERS           1000000
+
+// Random numbers with every digit count equally likely, not mostly 19 and 20 digit ones
+
+uint64 random_number() {
+    uint64 number = ((uint64) rand() << 40) ^ ((uint64) rand() << 20) ^ (uint64) rand();
+
+    return number >> (rand() % 64);
+}
+
+void fail(char *what, uint64 number, char *got, char *expected) {
+    printf("\nBUG, %s of %llu gave \"%s\", expected \"%s\"\n", what, number, got, expected);
+    exit(1);
+}
+
+uint8 bytes_for(uint64 number) {
+    uint8 bytes = 1;
+
+    while (bytes < 8 && number >> (bytes * 8) != 0)
+        bytes++;
+
+    return bytes;
+}
+
+void test_writers() {
+    printf("\nTesting the writers against printf... ");
+
+    char got[80];
+    char expected[80];
+
+    for (uint32 i = 0; i < FUZZ_ROUNDS; i++) {
+        uint64 number = i < 100 ? i : random_number();
+        uint8 bytes = bytes_for(number);
+
+        *write_decimal((uint8 *) got, number) = 0;
+        sprintf(expected, "%llu", number);
+
+        if (strcmp(got, expected) != 0 || decimal_length(number) != strlen(expected))
+            fail("write_decimal", number, got, expected);
+
+        *write_hex((uint8 *) got, number, bytes) = 0;
+        sprintf(expected, "%0*llX", bytes * 2, number);
+
+        if (strcmp(got, expected) != 0)
+            fail("write_hex", number, got, expected);
+
+        *write_binary((uint8 *) got, number, bytes) = 0;
+
+        for (uint8 bit = 0; bit < bytes * 8; bit++)
+            expected[bit] = (number >> (bytes * 8 - 1 - bit)) & 1 ? '1' : '0';
+
+        expected[bytes * 8] = 0;
+
+        if (strcmp(got, expected) != 0)
+            fail("write_binary", number, got, expected);
+    }
+
+    printf("OK\n");
+}
+
+void check_reader(char *what, uint64 (*reader)(uint8 *, uint16, uint16 *), char *text, uint16 length, int base) {
+    // Compare with strtoull, which also stops at the first character that isn't a digit
+
+    char copy[80];
+    char *end;
+    uint16 used;
+
+    memcpy(copy, text, length);
+    copy[length] = 0;
+
+    uint64 expected = strtoull(copy, &end, base);
+    uint64 got = reader((uint8 *) text, length, &used);
+
+    if (got != expected || used != end - copy) {
+        printf("\nBUG, %s of \"%s\" gave %llu using %u, expected %llu using %lu\n",
+               what, copy, got, used, expected, end - copy);
+        exit(1);
+    }
+}
+
+void test_readers() {
+    printf("\nTesting the readers against strtoull, stopping at every position... ");
+
+    char text[80];
+    char stoppers[] = "/:@G`g.|";                   // No spaces or signs, strtoull would skip over them
+
+    for (uint32 i = 0; i < FUZZ_ROUNDS; i++) {
+        uint64 number = random_number();
+        uint8 bytes = bytes_for(number);
+        uint8 length;
+
+        // Mix up the case of the hex letters, then put a stopper somewhere (maybe past the end)
+
+        length = sprintf(text, "%llu", number);
+        text[rand() % (length + 4)] = stoppers[rand() % (sizeof(stoppers) - 1)];
+        check_reader("read_decimal", read_decimal, text, length + (rand() % 4), 10);
+
+        length = sprintf(text, rand() % 2 ? "%0*llx" : "%0*llX", bytes * 2, number);
+        text[rand() % (length + 4)] = stoppers[rand() % (sizeof(stoppers) - 1)];
+        check_reader("read_hex", read_hex, text, length + (rand() % 4), 16);
+
+        length = bytes * 8;
+
+        for (uint8 bit = 0; bit < length; bit++)
+            text[bit] = (number >> (length - 1 - bit)) & 1 ? '1' : '0';
+
+        text[rand() % (length + 4)] = stoppers[rand() % (sizeof(stoppers) - 1)];
+        check_reader("read_binary", read_binary, text, length + (rand() % 4), 2);
+    }
+
+    printf("OK\n");
+}
+
+// The code these replaced, one digit at a time
+
+uint8 *old_write_decimal(uint8 *out, uint64 number) {
+    uint8 needed = 0;
+
+    for (uint64 working = number; working > 0; working = working / 10)
+        needed++;
+
+    if (needed == 0)
+        needed = 1;
+
+    uint8 stack[20];
+
+    for (uint8 i = 0; i < needed; i++) {
+        stack[i] = number % 10 + '0';
+        number = number / 10;
+    }
+
+    for (uint8 i = needed; i > 0; i--)
+        *out++ = stack[i - 1];
+
+    return out;
+}
+
+uint8 *old_write_hex(uint8 *out, uint64 number, uint8 bytes) {
+    for (int b = bytes - 1; b >= 0; b--) {
+        uint8 byte = (uint8) (number >> 8 * b);
+        uint8 highNibble = byte >> 4;
+        uint8 lowNibble = byte & 0x0F;
+        *out++ = highNibble + '0' + (highNibble > 9 ? 7 : 0);
+        *out++ = lowNibble + '0' + (lowNibble > 9 ? 7 : 0);
+    }
+
+    return out;
+}
+
+uint8 *old_write_binary(uint8 *out, uint64 number, uint8 bytes) {
+    for (int b = bytes - 1; b >= 0; b--) {
+        uint8 byte = (uint8) (number >> 8 * b);
+
+        for (int bit = 7; bit >= 0; bit--)
+            *out++ = ((byte & (1 << bit)) >> bit) + '0';
+    }
+
+    return out;
+}
+
+uint64 old_read_decimal(uint8 *text, uint16 length, uint16 *used) {
+    uint64 number = 0;
+    uint16 index = 0;
+
+    for (; index < length && text[index] >= '0' && text[index] <= '9'; index++)
+        number = number * 10 + text[index] - '0';
+
+    *used = index;
+
+    return number;
+}
+
+uint64 old_read_hex(uint8 *text, uint16 length, uint16 *used) {
+    uint64 number = 0;
+    uint16 index = 0;
+
+    for (; index < length; index++) {
+        char c = text[index];
+
+        if (!((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (c >= '0' && c <= '9')))
+            break;
+
+        c &= 0xDF;
+        c -= '0';
+
+        if (c > 9)
+            c -= 7;
+
+        number = (number << 4) + (c & 0xF);
+    }
+
+    *used = index;
+
+    return number;
+}
+
+double now() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void benchmark() {
+    static uint64 numbers[BENCHMARK_NUMBERS];
+    static uint8 text[BENCHMARK_NUMBERS * 21];
+    static uint16 lengths[BENCHMARK_NUMBERS];
+
+    for (uint32 i = 0; i < BENCHMARK_NUMBERS; i++)
+        numbers[i] = random_number();
+
+    printf("\nns per number, old -> new\n\n");
+
+    double start;
+    double times[2];
+    uint64 check = 0;
+    uint16 used;
+
+    // Decimal writing, then reading back what we wrote
+
+    uint8 *(*decimal_writers[2])(uint8 *, uint64) = {old_write_decimal, write_decimal};
+
+    for (uint8 w = 0; w < 2; w++) {
+        uint8 *out = text;
+        start = now();
+
+        for (uint32 i = 0; i < BENCHMARK_NUMBERS; i++) {
+            uint8 *end = decimal_writers[w](out, numbers[i]);
+            lengths[i] = end - out;
+            out += 21;
+        }
+
+        times[w] = (now() - start) / BENCHMARK_NUMBERS;
+    }
+
+    printf("%-14s %6.1f -> %6.1f\n", "write decimal", times[0], times[1]);
+
+    uint64 (*decimal_readers[2])(uint8 *, uint16, uint16 *) = {old_read_decimal, read_decimal};
+
+    for (uint8 r = 0; r < 2; r++) {
+        start = now();
+
+        for (uint32 i = 0; i < BENCHMARK_NUMBERS; i++)
+            check += decimal_readers[r](&text[i * 21], lengths[i], &used);
+
+        times[r] = (now() - start) / BENCHMARK_NUMBERS;
+    }
+
+    printf("%-14s %6.1f -> %6.1f\n", "read decimal", times[0], times[1]);
+
+    // Hex, all 8 bytes so the reader gets full runs of 8
+
+    uint8 *(*hex_writers[2])(uint8 *, uint64, uint8) = {old_write_hex, write_hex};
+
+    for (uint8 w = 0; w < 2; w++) {
+        start = now();
+
+        for (uint32 i = 0; i < BENCHMARK_NUMBERS; i++)
+            hex_writers[w](&text[i * 21], numbers[i], 8);
+
+        times[w] = (now() - start) / BENCHMARK_NUMBERS;
+    }
+
+    printf("%-14s %6.1f -> %6.1f\n", "write hex", times[0], times[1]);
+
+    uint64 (*hex_readers[2])(uint8 *, uint16, uint16 *) = {old_read_hex, read_hex};
+
+    for (uint8 r = 0; r < 2; r++) {
+        start = now();
+
+        for (uint32 i = 0; i < BENCHMARK_NUMBERS; i++)
+            check += hex_readers[r](&text[i * 21], 16, &used);
+
+        times[r] = (now() - start) / BENCHMARK_NUMBERS;
+    }
+
+    printf("%-14s %6.1f -> %6.1f\n", "read hex", times[0], times[1]);
+
+    // Binary, one byte each so it fits in the same text buffer
+
+    uint8 *(*binary_writers[2])(uint8 *, uint64, uint8) = {old_write_binary, write_binary};
+
+    for (uint8 w = 0; w < 2; w++) {
+        start = now();
+
+        for (uint32 i = 0; i < BENCHMARK_NUMBERS; i++)
+            binary_writers[w](&text[i * 21], numbers[i], 2);
+
+        times[w] = (now() - start) / BENCHMARK_NUMBERS;
+    }
+
+    printf("%-14s %6.1f -> %6.1f\n", "write binary", times[0], times[1]);
+
+    printf("\n(checksum %llu)\n", check);
+}
+
+int main() {
+    srand(11);
+
+    test_writers();
+    test_readers();
+
+    benchmark();
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+#import "../types.h"
+#import <stdio.h>
+#import <stdlib.h>
+
+// We're going to compare how many bytes each allocation wastes (block size - requested size) with the
+// old fixed 64/1024/16384 pools versus the table of power of two size classes from the memory code.
+
+// Same table as memory.c, CLASS(block bytes, percent of memory)
+
+#define SIZE_CLASSES(CLASS)                                                                 \
+    CLASS(64,       1)                                                                      \
+    CLASS(128,      2)                                                                      \
+    CLASS(256,      2)                                                                      \
+    CLASS(512,      3)                                                                      \
+    CLASS(1024,     5)                                                                      \
+    CLASS(2048,     5)                                                                      \
+    CLASS(4096,     7)                                                                      \
+    CLASS(8192,     10)                                                                     \
+    CLASS(16384,    15)
+
+#define CLASS_BYTES(bytes, percent)     bytes,
+#define CLASS_PERCENT(bytes, percent)   percent,
+
+uint32 class_bytes[] = { SIZE_CLASSES(CLASS_BYTES) };
+uint32 class_percent[] = { SIZE_CLASSES(CLASS_PERCENT) };
+
+// The pools are sized from whatever memory is left after the kernel, so assume about what a Pi 3 has
+// with the GPU's default 64 MiB split
+
+#define ASSUMED_MEMORY_BYTES        (944ULL * 1024 * 1024)
+#define MAXIMUM_POOL_BLOCKS         (64 * 64 * 64)
+
+#define CLASS_COUNT                 (sizeof(class_bytes) / sizeof(class_bytes[0]))
+
+uint32 old_block_for(uint32 size) {
+    if (size <= 64)
+        return 64;
+    else if (size <= 1024)
+        return 1024;
+    else
+        return 16384;
+}
+
+// Same as size_class_for() in memory.c
+
+uint32 new_block_for(uint32 size) {
+    if (size <= 64)
+        return class_bytes[0];
+
+    uint8 bits_needed = 64 - __builtin_clzll((uint64) size - 1);
+    uint8 size_class = bits_needed - __builtin_ctz(class_bytes[0]);
+
+    if (size_class >= CLASS_COUNT) {
+        printf("\nBUG, no class for %u\n", size);
+        exit(1);
+    }
+
+    return class_bytes[size_class];
+}
+
+void test_classes_fit() {
+    printf("\nTesting every size lands in the smallest class that fits... ");
+
+    for (uint32 size = 1; size <= 16384; size++) {
+        uint32 block = new_block_for(size);
+
+        if (block < size || (block > 64 && block / 2 >= size)) {
+            printf("\nBUG, %u went to %u\n", size, block);
+            exit(1);
+        }
+    }
+
+    printf("OK\n");
+}
+
+void report(char *name, uint32 smallest, uint32 largest) {
+    uint64 old_waste = 0;
+    uint64 new_waste = 0;
+    uint64 count = largest - smallest + 1;
+
+    for (uint32 size = smallest; size <= largest; size++) {
+        old_waste += old_block_for(size) - size;
+        new_waste += new_block_for(size) - size;
+    }
+
+    printf("%-28s %12.1f %12.1f\n", name, (double) old_waste / count, (double) new_waste / count);
+}
+
+// Same as init_memory_pools() in memory.c
+
+uint64 class_blocks(uint32 i) {
+    uint64 share = ASSUMED_MEMORY_BYTES / 100 * class_percent[i];
+    uint64 blocks = share > class_bytes[i] ? (share - class_bytes[i]) / (class_bytes[i] + 1) : 0;
+
+    return blocks < MAXIMUM_POOL_BLOCKS ? blocks : MAXIMUM_POOL_BLOCKS;
+}
+
+void report_live_objects(uint32 size) {
+    // How many objects of this size fit in all the pools at once, assuming they only spill upwards
+
+    uint64 old_total = old_block_for(size) == 64 ? 1024 : 0;
+    uint64 new_total = 0;
+
+    old_total += old_block_for(size) <= 1024 ? 1024 : 0;
+    old_total += 1024;
+
+    for (uint32 i = 0; i < CLASS_COUNT; i++) {
+        if (class_bytes[i] >= size)
+            new_total += class_blocks(i);
+    }
+
+    printf("%-28u %12llu %12llu\n", size, old_total, new_total);
+}
+
+int main() {
+    test_classes_fit();
+
+    printf("\nAverage bytes wasted per allocation\n\n");
+    printf("%-28s %12s %12s\n", "Request sizes", "Old", "New");
+
+    report("1 - 16384 (all)", 1, 16384);
+    report("1 - 1024 (strings)", 1, 1024);
+    report("65 - 128", 65, 128);
+    report("1025 - 2048", 1025, 2048);
+
+    printf("\nLive objects that fit at once\n\n");
+    printf("%-28s %12s %12s\n", "Object size", "Old", "New");
+
+    report_live_objects(65);
+    report_live_objects(200);
+    report_live_objects(1025);
+    report_live_objects(5000);
+
+    printf("\n");
+}
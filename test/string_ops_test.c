@@ -0,0 +1,206 @@
+#define _GNU_SOURCE                                                 // For memmem() on Linux
+#import "../types.h"
+#import <stdio.h>
+#import <stdlib.h>
+#import <string.h>
+#import <strings.h>
+#import <time.h>
+
+// The search and compare kernels are plain C, so we test the real thing. Random buffers at every alignment
+// go through each kernel and are checked against the C library, then each kernel is timed against a byte at
+// a time loop on 16 byte, 256 byte and 16k inputs. It's built freestanding like the kernel, otherwise the
+// compiler swaps the byte at a time loops for calls to the C library.
+
+#import "../string_ops.c"
+
+#define FUZZ_ROUNDS                 200000
+#define BUFFER_BYTES                16384
+#define BENCHMARK_BYTES             (1 << 24)                       // How much each timing goes through in total
+
+static uint8 one[BUFFER_BYTES + 16];
+static uint8 two[BUFFER_BYTES + 16];
+static uint8 three[BUFFER_BYTES + 16];
+
+int sign(int number) {
+    return (number > 0) - (number < 0);
+}
+
+void fail(char *what, uint16 offset, uint16 length, long got, long expected) {
+    printf("\nBUG, %s at offset %u length %u gave %ld, expected %ld\n", what, offset, length, got, expected);
+    exit(1);
+}
+
+void fill(uint8 *bytes, uint16 length) {
+    // A small alphabet (with both cases and a few bytes over 0x80) so matches and near misses are common
+
+    static uint8 alphabet[] = "abcABC\xC3\xA9\xDA";
+
+    for (uint16 i = 0; i < length; i++)
+        bytes[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+}
+
+void test_kernels() {
+    printf("\nTesting the kernels against the C library at every alignment... ");
+
+    for (uint32 round = 0; round < FUZZ_ROUNDS; round++) {
+        uint16 length = round % 4 == 0 ? rand() % 1024 : rand() % 64;
+        uint16 offset_one = rand() % 8;
+        uint16 offset_two = rand() % 8;
+        uint8 *a = &one[offset_one];
+        uint8 *b = &two[offset_two];
+
+        // Make b a copy of a with a change or two somewhere (maybe just in case)
+
+        fill(a, length);
+        memcpy(b, a, length);
+
+        if (length > 0 && rand() % 2) {
+            uint16 at = rand() % length;
+            b[at] = rand() % 2 ? b[at] ^ 0x20 : rand();
+        }
+
+        if (sign(compare_bytes(a, b, length)) != sign(memcmp(a, b, length)))
+            fail("compare_bytes", offset_one, length, compare_bytes(a, b, length), memcmp(a, b, length));
+
+        // strncasecmp stops at a 0, so only check when there isn't one
+
+        if (memchr(a, 0, length) == null && memchr(b, 0, length) == null &&
+            sign(compare_bytes_ignoring_case(a, b, length)) != sign(strncasecmp((char *) a, (char *) b, length)))
+            fail("compare_bytes_ignoring_case", offset_one, length, compare_bytes_ignoring_case(a, b, length),
+                 strncasecmp((char *) a, (char *) b, length));
+
+        uint8 c = a[length > 0 ? rand() % length : 0];
+        uint8 *found = memchr(a, c, length);
+
+        if (find_byte(a, length, c) != (found == null ? -1 : found - a))
+            fail("find_byte", offset_one, length, find_byte(a, length, c), found == null ? -1 : found - a);
+
+        uint16 pattern_length = length > 0 ? rand() % 12 : 0;
+        uint8 *pattern = &b[length > pattern_length ? rand() % (length - pattern_length) : 0];
+
+        found = memmem(a, length, pattern, pattern_length);
+
+        if (find_bytes(a, length, pattern, pattern_length) != (found == null ? -1 : found - a))
+            fail("find_bytes", offset_one, length, find_bytes(a, length, pattern, pattern_length),
+                 found == null ? -1 : found - a);
+
+        a[length] = 0;
+
+        if (cstring_length((char *) a) != strlen((char *) a))
+            fail("cstring_length", offset_one, length, cstring_length((char *) a), strlen((char *) a));
+    }
+
+    printf("OK\n");
+}
+
+// The byte at a time code to compare with
+
+uint64 old_cstring_length(char *text) {
+    uint64 size = 0;
+
+    while (text[size] != 0x00)
+        size++;
+
+    return size;
+}
+
+int16 old_compare_bytes(uint8 *one, uint8 *two, uint16 length) {
+    for (uint16 i = 0; i < length; i++)
+        if (one[i] != two[i])
+            return (int16) one[i] - (int16) two[i];
+
+    return 0;
+}
+
+int16 old_compare_bytes_ignoring_case(uint8 *one, uint8 *two, uint16 length) {
+    for (uint16 i = 0; i < length; i++) {
+        uint8 c1 = one[i] >= 'A' && one[i] <= 'Z' ? one[i] + 32 : one[i];
+        uint8 c2 = two[i] >= 'A' && two[i] <= 'Z' ? two[i] + 32 : two[i];
+
+        if (c1 != c2)
+            return (int16) c1 - (int16) c2;
+    }
+
+    return 0;
+}
+
+int32 old_find_byte(uint8 *bytes, uint16 length, uint8 c) {
+    for (uint16 i = 0; i < length; i++)
+        if (bytes[i] == c)
+            return i;
+
+    return -1;
+}
+
+int32 old_find_bytes(uint8 *bytes, uint16 length, uint8 *pattern, uint16 pattern_length) {
+    for (int32 i = 0; i + pattern_length <= length; i++)
+        if (old_compare_bytes(&bytes[i], pattern, pattern_length) == 0)
+            return i;
+
+    return -1;
+}
+
+double now() {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void benchmark() {
+    uint16 sizes[] = {16, 256, BUFFER_BYTES};
+    volatile int64 check = 0;
+
+    printf("\nns per call, old -> new\n");
+
+    for (uint8 s = 0; s < 3; s++) {
+        uint16 size = sizes[s];
+        uint32 repeats = BENCHMARK_BYTES / size;
+        double start;
+        double times[2];
+
+        // Text with no zeros, a copy of it, a copy with the case flipped, and a pattern that's only at the end
+
+        fill(one, size);
+        one[size - 1] = 'x';
+        memcpy(two, one, size);
+        memcpy(three, one, size);
+        one[size] = 0;
+
+        for (uint16 i = 0; i < size; i++)
+            two[i] ^= (two[i] >= 'a' && two[i] <= 'z') ? 0x20 : 0;
+
+        uint8 pattern[] = {'a', 'b', 'y'};
+
+        printf("\n%u bytes\n", size);
+
+#define TIME(name, old_call, new_call) \
+        start = now(); \
+        for (uint32 r = 0; r < repeats; r++) check += old_call; \
+        times[0] = (now() - start) / repeats; \
+        start = now(); \
+        for (uint32 r = 0; r < repeats; r++) check += new_call; \
+        times[1] = (now() - start) / repeats; \
+        printf("%-20s %8.1f -> %8.1f\n", name, times[0], times[1]);
+
+        TIME("length", old_cstring_length((char *) one), cstring_length((char *) one));
+        TIME("compare", old_compare_bytes(one, three, size), compare_bytes(one, three, size));
+        TIME("compare ignoring case", old_compare_bytes_ignoring_case(one, two, size),
+             compare_bytes_ignoring_case(one, two, size));
+        TIME("find byte", old_find_byte(one, size, 'x'), find_byte(one, size, 'x'));
+        TIME("find bytes", old_find_bytes(one, size, pattern, 3), find_bytes(one, size, pattern, 3));
+    }
+
+    printf("\n(checksum %lld)\n", (long long) check);
+}
+
+int main() {
+    srand(19);
+
+    test_kernels();
+
+    benchmark();
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#import "../types.h"
+#import <stdio.h>
+
+// Splits, trims and parses a command line the way a shell on the UART would, checking every piece and that
+// nothing gets allocated along the way. The memory and UART code are stand ins, the view code is the real one.
+
+#import "../convert.c"
+#import "../string_ops.c"
+#import "../view.c"
+
+static uint8 heap[4096];
+static uint64 heap_used = 0;
+static uint64 allocations = 0;
+
+void *allocate_uninitialized(uint64 size) {
+    allocations++;
+    heap_used += size;
+
+    return &heap[heap_used - size];
+}
+
+void copy_memory(void *src, void *dest, uint64 size) {
+    __builtin_memcpy(dest, src, size);
+}
+
+void uart_send_string(string *s) {
+    printf("%.*s\n", s->size - 2, (char *) &s->data);
+}
+
+void halt() {
+    __builtin_abort();
+}
+
+static uint32 failures = 0;
+
+void check(bool passed, char *what) {
+    if (!passed) {
+        printf("BUG, %s\n", what);
+        failures++;
+    }
+}
+
+void check_view(string_view view, string *expected, char *what) {
+    if (!views_equal(view, view_of_string(expected))) {
+        printf("BUG, %s gave \"%.*s\", expected \"%.*s\"\n", what, view.length, (char *) view.bytes,
+               expected->size - 2, (char *) &expected->data);
+        failures++;
+    }
+}
+
+void test_words_and_numbers() {
+    string *line = LITERAL("  poke  0x1F00 -42\t0b101 ok\r\n");
+    string_view rest = view_of_string(line);
+    string_view word;
+    uint64 number;
+    bool negative;
+
+    check(next_word(&rest, &word), "first word missing");
+    check_view(word, LITERAL("poke"), "first word");
+
+    check(next_word(&rest, &word) && view_to_number(word, &number, &negative), "hex word");
+    check(number == 0x1F00 && !negative, "hex value");
+
+    check(next_word(&rest, &word) && view_to_number(word, &number, &negative), "negative word");
+    check((int64) number == -42 && negative, "negative value");
+    check(!view_to_number(word, &number, null), "negative number accepted where it wasn't expected");
+
+    check(next_word(&rest, &word) && view_to_number(word, &number, &negative), "binary word");
+    check(number == 5, "binary value");
+
+    check(next_word(&rest, &word) && !view_to_number(word, &number, &negative), "ok parsed as a number");
+    check(!next_word(&rest, &word), "words after the end");
+
+    char *not_numbers[] = {"", "-", "0x", "0b", "12a", "0x1G", "0b102", "--1"};
+
+    for (uint8 i = 0; i < sizeof(not_numbers) / sizeof(not_numbers[0]); i++) {
+        uint16 length = 0;
+
+        while (not_numbers[i][length] != 0)
+            length++;
+
+        if (view_to_number((string_view) {(uint8 *) not_numbers[i], length}, &number, &negative)) {
+            printf("BUG, \"%s\" parsed as a number\n", not_numbers[i]);
+            failures++;
+        }
+    }
+}
+
+void test_split_and_slice() {
+    string_view rest = view_of_string(LITERAL("a,,bc,"));
+
+    check_view(split_view(&rest, ','), LITERAL("a"), "split 1");
+    check_view(split_view(&rest, ','), LITERAL(""), "split 2");
+    check_view(split_view(&rest, ','), LITERAL("bc"), "split 3");
+    check(rest.length == 0, "split left something after the last separator");
+    check_view(split_view(&rest, ','), LITERAL(""), "split of nothing");
+
+    string_view all = view_of_string(LITERAL("hello world"));
+
+    check_view(slice_view(all, 6, 5), LITERAL("world"), "slice");
+    check_view(slice_view(all, 6, 100), LITERAL("world"), "slice past the end");
+    check_view(slice_view(all, 100, 5), LITERAL(""), "slice starting past the end");
+    check_view(trim_view(view_of_string(LITERAL(" \t\r\n "))), LITERAL(""), "trim of only spaces");
+    check(view_starts_with(all, view_of_string(LITERAL("hello"))), "starts with");
+    check(!view_starts_with(view_of_string(LITERAL("he")), view_of_string(LITERAL("hello"))), "short starts with");
+}
+
+int main() {
+    test_words_and_numbers();
+    test_split_and_slice();
+
+    check(allocations == 0, "views allocated");
+
+    string *copy = string_from_view(slice_view(view_of_string(LITERAL("keep this")), 5, 4));
+
+    check(allocations == 1 && copy->size == 6, "string from view");
+    check_view(view_of_string(copy), LITERAL("this"), "string from view");
+
+    printf(failures == 0 ? "All views OK\n" : "%u failures\n", failures);
+
+    return failures != 0;
+}
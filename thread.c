@@ -0,0 +1,485 @@
+#import "types.h"
+#import "smp.h"
+#import "irq.h"
+#import "timer.h"
+#import "idle.h"
+#import "memory.h"
+#import "thread.h"
+#import "benchmark.h"
+
+// Each core has its own run queue and takes the thread at its head whenever it switches. A core whose queue
+// is empty steals the oldest thread it's allowed to run from another core's queue before it settles for its
+// idle thread, so new threads (which go in the queue of the core making them) spread out by themselves.
+//
+// There's no regular tick. Each core's physical timer is set for the next thing that needs it, the end of the
+// running thread's turn (only if another thread is waiting for the core) or the first of its sleeping threads
+// waking up, and is off when there's neither. A core running one thread, or idle in WFI, isn't interrupted
+// at all. When a turn ends, at the end of that IRQ the thread goes to the back of the queue. The switch
+// happens right there inside the IRQ, on the interrupted thread's stack, and it carries on from there
+// (returning from the IRQ) when it's next picked.
+//
+// Queueing a thread wakes an idle core that may run it, or failing that tells the core whose queue it went in
+// (if it isn't ours) so that core can set its timer to end its current thread's turn.
+//
+// A thread that's switched away from is still on its stack until switch_context() is done with it, so it
+// only goes back in a queue (or to sleep, or gets marked finished) afterwards, by whichever thread runs next.
+
+#define SLICE_MICROSECONDS              10000                       // How long a turn is with others waiting
+#define JOINER_FINISHED                 1                           // In a thread's joiner once it's finished
+
+typedef struct __attribute__((aligned(CACHE_LINE_BYTES))) {
+    spinlock lock;                      // Held while changing the queue, by this core or one stealing from it
+    thread *head;                       // The next to run
+    thread *tail;
+    volatile uint32 length;
+    thread *current;                    // What this core is running, only this core touches the rest
+    thread *idle;                       // Runs when there's nothing else to
+    thread *sleeping;                   // Soonest to wake first, linked through next
+    uint64 slice_end;                   // When the current thread's turn is up
+    uint64 timer_deadline;              // What the timer is set for, 0 when it's off
+    bool reschedule;                    // The timer says the current thread's turn is up
+    uint64 switches;
+} run_queue;
+
+static run_queue queues[CORE_COUNT];
+static thread boot_threads[CORE_COUNT];                             // What each core ran before it had threads
+static uint64 slice_ticks;                                          // SLICE_MICROSECONDS in timer ticks
+
+extern thread *switch_context(thread *from, thread *to);            // In context.S
+
+// Local functions
+
+static void push_thread(run_queue *queue, thread *t) {
+    // The queue's lock must be held
+
+    t->next = null;
+
+    if (queue->tail == null)
+        queue->head = t;
+    else
+        queue->tail->next = t;
+
+    queue->tail = t;
+    queue->length++;
+}
+
+static thread *pop_thread(run_queue *queue, uint8 core) {
+    // The first thread the core is allowed to run, the queue's lock must be held
+
+    thread *previous = null;
+
+    for (thread *t = queue->head; t != null; previous = t, t = t->next) {
+        if ((t->allowed_cores & (1 << core)) == 0)
+            continue;
+
+        if (previous == null)
+            queue->head = t->next;
+        else
+            previous->next = t->next;
+
+        if (queue->tail == t)
+            queue->tail = previous;
+
+        queue->length--;
+
+        return t;
+    }
+
+    return null;
+}
+
+static thread *find_next_thread(uint8 core) {
+    // Our own queue first, then steal from the others, starting with the next core along
+
+    for (uint8 i = 0; i < CORE_COUNT; i++) {
+        run_queue *queue = &queues[(core + i) % CORE_COUNT];
+
+        if (queue->length == 0)
+            continue;
+
+        acquire_lock(&queue->lock);
+
+        thread *t = pop_thread(queue, core);
+
+        release_lock(&queue->lock);
+
+        if (t != null)
+            return t;
+    }
+
+    return null;
+}
+
+static void make_ready(thread *t, uint8 core) {
+    // Queue it on the given core if it may run there, otherwise on the first core it may
+
+    if ((t->allowed_cores & (1 << core)) == 0)
+        core = __builtin_ctz(t->allowed_cores);
+
+    t->state = THREAD_READY;
+
+    run_queue *queue = &queues[core];
+
+    acquire_lock(&queue->lock);
+    push_thread(queue, t);
+    release_lock(&queue->lock);
+
+    // An idle core takes it (from any queue) soonest, otherwise the core it's queued on needs to know
+
+    if (!wake_idle_core(t->allowed_cores) && core != this_core()->core)
+        wake_core(core);
+}
+
+static void add_sleeper(run_queue *queue, thread *t) {
+    // Keep them in the order they wake up
+
+    thread **link = &queue->sleeping;
+
+    while (*link != null && (*link)->wake_time <= t->wake_time)
+        link = &(*link)->next;
+
+    t->next = *link;
+    *link = t;
+}
+
+static void update_timer(run_queue *queue) {
+    // Set this core's timer for whichever comes first, the end of the current thread's turn if there's
+    // another waiting (or may be, the queue can hold threads only other cores can run) or the next sleeper
+    // waking up. Only touch the timer if that's changed. IRQs must be masked.
+
+    uint64 deadline = 0;
+
+    if (queue->length > 0 && queue->current != queue->idle)
+        deadline = queue->slice_end;
+
+    if (queue->sleeping != null && (deadline == 0 || queue->sleeping->wake_time < deadline))
+        deadline = queue->sleeping->wake_time;
+
+    if (deadline == queue->timer_deadline)
+        return;
+
+    queue->timer_deadline = deadline;
+
+    if (deadline == 0)
+        stop_timer();
+    else
+        set_timer(deadline);
+}
+
+static void finish_thread(thread *t) {
+    // Mark it finished, and whoever's already waiting to join it can run. Once the joiner is swapped for
+    // JOINER_FINISHED the joiner may free it, so that's the last we touch it.
+
+    __atomic_store_n(&t->state, THREAD_FINISHED, __ATOMIC_RELEASE);
+
+    uint64 joiner;
+
+    do {
+        joiner = t->joiner;
+    } while (!atomic_compare_and_swap(&t->joiner, joiner, JOINER_FINISHED));
+
+    if (joiner != 0)
+        make_ready((thread *) joiner, this_core()->core);
+}
+
+static void wait_to_join(thread *t) {
+    // Leave ourselves for the thread we're joining to wake, unless it finished while we were switching
+
+    if (!atomic_compare_and_swap(&t->joining->joiner, 0, (uint64) t))
+        make_ready(t, this_core()->core);
+}
+
+static void finish_switch(thread *previous) {
+    // Now we're off its stack, the thread we switched away from can be run again, put to sleep or freed
+
+    run_queue *queue = &queues[this_core()->core];
+
+    if (previous->state == THREAD_EXITING)
+        finish_thread(previous);
+    else if (previous->state == THREAD_JOINING)
+        wait_to_join(previous);
+    else if (previous->state == THREAD_SLEEPING)
+        add_sleeper(queue, previous);
+    else if (previous != queue->idle)
+        make_ready(previous, this_core()->core);
+
+    update_timer(queue);
+}
+
+static void schedule() {
+    // Switch to the next thread in line, or keep going if there isn't one. IRQs must be masked.
+
+    uint8 core = this_core()->core;
+    run_queue *queue = &queues[core];
+    thread *current = queue->current;
+
+    queue->reschedule = false;
+
+    thread *next = find_next_thread(core);
+
+    if (next == null) {
+        if (current->state == THREAD_RUNNING) {
+            queue->slice_end = read_timer() + slice_ticks;
+
+            update_timer(queue);
+
+            return;
+        }
+
+        next = queue->idle;
+    }
+
+    next->state = THREAD_RUNNING;
+    queue->current = next;
+    queue->slice_end = read_timer() + slice_ticks;
+    queue->switches++;
+
+    thread *previous = switch_context(current, next);
+
+    // We're back, maybe on another core
+
+    finish_switch(previous);
+}
+
+static void run_new_thread(thread *previous) {
+    // Where a new thread's first switch_context() returns to, IRQs are still masked from the switch
+
+    finish_switch(previous);
+
+    enable_interrupts();
+
+    thread *self = current_thread();
+
+    self->entry(self->argument);
+
+    exit_thread();
+}
+
+static thread *new_thread(void (*entry)(void *argument), void *argument, uint8 allowed_cores) {
+    // Its stack starts with a context for switch_context() to return from into run_new_thread()
+
+    thread *t = allocate(sizeof(thread));
+
+    t->stack = allocate_pages(THREAD_STACK_BYTES);
+    t->entry = entry;
+    t->argument = argument;
+    t->allowed_cores = allowed_cores == 0 ? ALL_CORES : allowed_cores;
+
+    uint64 *context = (uint64 *) (t->stack + THREAD_STACK_BYTES - THREAD_CONTEXT_BYTES);
+
+    zero_memory(context, THREAD_CONTEXT_BYTES);
+
+    context[THREAD_CONTEXT_FRAME_POINTER] = 0;                      // The end of the frame chain for a debugger
+    context[THREAD_CONTEXT_LINK_REGISTER] = (uint64) run_new_thread;
+
+    t->stack_pointer = (uint64) context;
+
+    return t;
+}
+
+static bool work_waiting() {
+    // Whether any queue has a thread this core may run, for idle_core() to check after it's marked us idle
+
+    uint8 core = this_core()->core;
+
+    for (uint8 i = 0; i < CORE_COUNT; i++) {
+        run_queue *queue = &queues[i];
+        bool found = false;
+
+        if (queue->length == 0)
+            continue;
+
+        acquire_lock(&queue->lock);
+
+        for (thread *t = queue->head; t != null && !found; t = t->next)
+            found = (t->allowed_cores & (1 << core)) != 0;
+
+        release_lock(&queue->lock);
+
+        if (found)
+            return true;
+    }
+
+    return false;
+}
+
+static void idle(void *unused) {
+    // Look for something to run, and failing that get memory ready for later. Once there's nothing left to
+    // do sleep until an IRQ, from our timer for a sleeper, a device, or another core that queued a thread.
+
+    while (true) {
+        yield();
+
+        if (prepare_zeroed_blocks())
+            continue;
+
+        disable_interrupts();
+        idle_core(work_waiting);
+        enable_interrupts();                                        // Whatever woke us runs here
+    }
+}
+
+static void timer_expired(void *unused) {
+    // Wake the sleepers that are due and see if the current thread's turn is up, preempt_if_needed() at the
+    // end of the IRQ sets the timer again for whatever's next
+
+    run_queue *queue = &queues[this_core()->core];
+    uint64 now = read_timer();
+
+    stop_timer();
+    queue->timer_deadline = 0;
+
+    while (queue->sleeping != null && queue->sleeping->wake_time <= now) {
+        thread *t = queue->sleeping;
+
+        queue->sleeping = t->next;
+
+        make_ready(t, this_core()->core);
+    }
+
+    if (now >= queue->slice_end)
+        queue->reschedule = true;
+}
+
+static void start_this_core() {
+    // What the core's been running becomes its boot thread, it stays on this core since it's on its stack
+
+    uint8 core = this_core()->core;
+    run_queue *queue = &queues[core];
+    thread *boot = &boot_threads[core];
+
+    boot->state = THREAD_RUNNING;
+    boot->allowed_cores = 1 << core;
+
+    queue->idle = new_thread(idle, null, 1 << core);
+    queue->idle->state = THREAD_RUNNING;
+    queue->current = boot;
+    queue->slice_end = read_timer() + slice_ticks;
+
+    init_idle();
+
+    enable_irq_line(IRQ_LOCAL_PHYSICAL_TIMER);
+
+    enable_interrupts();
+}
+
+// Functions
+
+void init_threads() {
+    slice_ticks = timer_frequency() * SLICE_MICROSECONDS / 1000000;
+
+    register_irq_handler(IRQ_LOCAL_PHYSICAL_TIMER, timer_expired, null);
+
+    start_this_core();
+}
+
+void start_threads(void *unused) {
+    // The boot thread has nothing to do here, so it goes and the idle thread takes over. The IRQ statistics
+    // need this core's cycle counter running too.
+
+    init_cycle_counter();
+    start_this_core();
+
+    exit_thread();
+}
+
+thread *create_thread(void (*entry)(void *argument), void *argument, uint8 allowed_cores) {
+    thread *t = new_thread(entry, argument, allowed_cores);
+
+    uint64 interrupts = save_and_disable_interrupts();
+
+    make_ready(t, this_core()->core);
+    update_timer(&queues[this_core()->core]);
+
+    restore_interrupts(interrupts);
+
+    return t;
+}
+
+void yield() {
+    uint64 interrupts = save_and_disable_interrupts();
+
+    schedule();
+
+    restore_interrupts(interrupts);
+}
+
+void sleep_thread(uint64 microseconds) {
+    uint64 interrupts = save_and_disable_interrupts();
+
+    thread *self = queues[this_core()->core].current;
+
+    self->wake_time = read_timer() + microseconds * timer_frequency() / 1000000;
+    self->state = THREAD_SLEEPING;
+
+    schedule();
+
+    restore_interrupts(interrupts);
+}
+
+void exit_thread() {
+    thread *self = current_thread();
+
+    if (self->scratch != null)
+        destroy_arena(&self->scratch);
+
+    disable_interrupts();
+
+    self->state = THREAD_EXITING;
+
+    schedule();
+
+    // It never comes back
+
+    while (true) {};
+}
+
+void join_thread(thread **t) {
+    // finish_thread() or wait_to_join() makes us ready again once it's finished
+
+    uint64 interrupts = save_and_disable_interrupts();
+
+    if (__atomic_load_n(&(*t)->joiner, __ATOMIC_ACQUIRE) != JOINER_FINISHED) {
+        thread *self = queues[this_core()->core].current;
+
+        self->joining = *t;
+        self->state = THREAD_JOINING;
+
+        schedule();
+    }
+
+    restore_interrupts(interrupts);
+
+    free_pages(&(*t)->stack);
+    free((void **) t);
+}
+
+thread *current_thread() {
+    // IRQs are masked so we can't move to another core between finding ours and reading it
+
+    uint64 interrupts = save_and_disable_interrupts();
+
+    thread *current = queues[this_core()->core].current;
+
+    restore_interrupts(interrupts);
+
+    return current;
+}
+
+uint64 thread_switches() {
+    uint64 switches = 0;
+
+    for (uint8 core = 0; core < CORE_COUNT; core++)
+        switches += queues[core].switches;
+
+    return switches;
+}
+
+void preempt_if_needed() {
+    run_queue *queue = &queues[this_core()->core];
+
+    if (queue->reschedule)
+        schedule();
+    else
+        update_timer(queue);
+}
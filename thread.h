@@ -0,0 +1,76 @@
+#include "types.h"
+#include "smp.h"
+#include "arena.h"
+
+#ifndef __thread_h__
+#define	__thread_h__
+
+#define THREAD_STACK_BYTES              16384
+#define ALL_CORES                       ((1 << CORE_COUNT) - 1)
+
+// What switch_context() in context.S leaves on the stack: x19 - x30, then d8 - d15 with SIMD
+#ifdef USE_SIMD
+#define THREAD_CONTEXT_BYTES            ((12 * 8) + (8 * 8))
+#else
+#define THREAD_CONTEXT_BYTES            (12 * 8)
+#endif
+
+#define THREAD_CONTEXT_FRAME_POINTER    10                          // Which double word x29 is in
+#define THREAD_CONTEXT_LINK_REGISTER    11                          // And x30, where switch_context() returns to
+
+#define THREAD_READY                    0                           // Waiting in a run queue
+#define THREAD_RUNNING                  1
+#define THREAD_SLEEPING                 2                           // In sleep_thread(), on its core's sleeping list
+#define THREAD_JOINING                  3                           // In join_thread(), waiting for the other to finish
+#define THREAD_EXITING                  4                           // Called exit_thread(), still on its stack
+#define THREAD_FINISHED                 5                           // Off its stack for good, join_thread() can free it
+
+typedef struct thread {
+    uint64 stack_pointer;               // Where switch_context() left its registers, must be first
+    struct thread *next;                // The next thread in the same run queue (or sleeping list)
+    void (*entry)(void *argument);
+    void *argument;
+    void *stack;                        // From allocate_pages(), null for a core's boot thread
+    uint64 wake_time;                   // When a sleeping thread is due to wake, in timer ticks
+    struct thread *joining;             // What a joining thread is waiting for
+    volatile uint64 joiner;             // The thread joining this one, or JOINER_FINISHED in thread.c
+    arena *scratch;                     // Its scratch_arena(), made the first time it asks for one
+    volatile uint8 state;
+    uint8 allowed_cores;                // Bit n is set if core n may run it
+} thread;
+
+// Turns main() into a thread and starts the scheduler on the main core, init_memory_pools() and init_irq()
+// must have run first
+void init_threads();
+
+// Starts the scheduler on a secondary core, for start_core(). It never returns, so the core stays busy.
+void start_threads(void *unused);
+
+// Makes a thread that runs entry(argument) on any of the allowed cores (ALL_CORES for any of them) and
+// queues it to run, its stack and control block come from memory.c
+thread *create_thread(void (*entry)(void *argument), void *argument, uint8 allowed_cores);
+
+// Lets another thread run if there's one waiting, this one goes to the back of the queue
+void yield();
+
+// Lets other threads run for at least the given time, the core sleeps if none want to. It wakes up on the
+// same core, but may be stolen by another one once it's ready.
+void sleep_thread(uint64 microseconds);
+
+// Ends the thread that calls it, returning from the entry function does the same
+__attribute__((__noreturn__)) void exit_thread();
+
+// Waits for the thread to finish without running, then frees it and nulls out the pointer. Only one thread
+// may join each thread.
+void join_thread(thread **t);
+
+// The thread that's running on this core
+thread *current_thread();
+
+// How many times the cores have switched threads in total
+uint64 thread_switches();
+
+// Called at the end of every IRQ, switches threads if this one's turn is up and sets the timer for what's next
+void preempt_if_needed();
+
+#endif
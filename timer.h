@@ -0,0 +1,39 @@
+#include "types.h"
+
+#ifndef __timer_h__
+#define	__timer_h__
+
+// The ARM generic timer. Every core sees the same counter, running at timer_frequency() ticks a second, and
+// has its own physical timer that raises IRQ_LOCAL_PHYSICAL_TIMER once the counter reaches its deadline. The
+// scheduler in thread.c owns this core's physical timer.
+
+// Reads the counter, the ISB stops it being read early, before the code we're timing finishes
+static inline uint64 read_timer() {
+    uint64 ticks;
+
+    asm volatile ("isb\n\tmrs %0, cntpct_el0" : "=r" (ticks));
+
+    return ticks;
+}
+
+// How many ticks the counter goes up by each second
+static inline uint64 timer_frequency() {
+    uint64 frequency;
+
+    asm volatile ("mrs %0, cntfrq_el0" : "=r" (frequency));
+
+    return frequency;
+}
+
+// Has this core's physical timer go off once the counter reaches the deadline, setting it again also
+// acknowledges the last one
+static inline void set_timer(uint64 deadline) {
+    asm volatile ("msr cntp_cval_el0, %0\n\tmsr cntp_ctl_el0, %1\n\tisb" : : "r" (deadline), "r" (1ULL));
+}
+
+// Turns this core's physical timer off
+static inline void stop_timer() {
+    asm volatile ("msr cntp_ctl_el0, xzr\n\tisb");
+}
+
+#endif
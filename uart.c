@@ -0,0 +1,347 @@
+#import "types.h"
+#import "memory.h"
+#import "convert.h"
+#import "smp.h"
+#import "irq.h"
+#import "idle.h"
+#import "timer.h"
+#import "uart.h"
+
+#ifdef USE_PL011
+#import "pl011.h"
+#else
+#import "mini_uart.h"
+#endif
+
+// The UART is driven by its interrupt. Sending puts bytes in the transmit ring and returns, and the interrupt
+// moves them into the UART's FIFO as it empties. The interrupt also moves every byte that arrives into the
+// receive ring, so nothing is lost while the kernel is busy elsewhere.
+//
+// Each ring has one side that adds and one that takes, so they need no locks, just ordered updates of the
+// head (where the next byte is taken from) and the tail (where the next byte goes). The counts run freely
+// and wrap, only their difference matters.
+//
+// The interrupt goes to the main core, which does the UART's side (servicing). Other cores only add to the
+// ring, and if it was empty they kick the main core through a mailbox, since the PL011 won't interrupt
+// until its FIFO drains past the trigger level. When they have to wait on the UART they leave it to the
+// main core, unless it hasn't moved anything for UART_STALL_MICROSECONDS (it may have IRQs masked, be
+// waiting on a lock they hold, or be halted). Then they service it themselves, only one core at a time may
+// and the others see it's busy and leave it. The main core with IRQs masked does the work itself rather
+// than wait on an interrupt that can't come, which also keeps panics and early boot working.
+//
+// Which UART it is lives in mini_uart.h or pl011.h (build with PL011=1 for the PL011), everything else here
+// is the same for both.
+
+#define TRANSMIT_BUFFER_BYTES           4096                        // Must be a power of two
+#define RECEIVE_BUFFER_BYTES            1024                        // Must be a power of two
+#define UART_MAILBOX                    1                           // The local mailbox other cores kick us with
+#define UART_STALL_MICROSECONDS         2000                        // How long other cores leave it to the main core
+
+static uint8 transmit_buffer[TRANSMIT_BUFFER_BYTES];
+static volatile uint32 transmit_head;                               // Only the servicing core moves this
+static volatile uint32 transmit_tail;                               // Only the core holding sending moves this
+
+static uint8 receive_buffer[RECEIVE_BUFFER_BYTES];
+static volatile uint32 receive_head;                                // Only the (one) reading core moves this
+static volatile uint32 receive_tail;                                // Only the servicing core moves this
+
+static spinlock sending;                                            // Held while adding to the transmit ring
+static spinlock servicing;                                          // Held while moving bytes to or from the UART
+
+uint64 uart_bytes_dropped;                                          // Bytes that arrived with the receive ring full
+
+// What a core waiting on the UART has seen of the main core's progress
+typedef struct {
+    uint32 head;                        // The transmit head, as we last left it
+    uint64 moved;                       // When someone else last moved it, in timer ticks
+} uart_progress;
+
+// Local functions
+
+static bool try_to_service() {
+    // Like acquire_lock() but we give up straight away if another core has it
+
+#ifndef NO_MMU
+    return __atomic_exchange_n(&servicing, 1, __ATOMIC_ACQUIRE) == 0;
+#else
+    return true;
+#endif
+}
+
+static void service_uart() {
+    // Keep our own interrupt out while we're at it, otherwise it would find the UART busy and come straight
+    // back, over and over, without letting us finish
+
+    uint64 interrupts = save_and_disable_interrupts();
+
+    if (!try_to_service()) {
+        restore_interrupts(interrupts);
+        return;
+    }
+
+    // Take everything that's arrived
+
+    uint32 tail = receive_tail;
+
+    while (uart_byte_waiting()) {
+        uint8 byte = uart_read_byte();
+
+        if (tail - __atomic_load_n(&receive_head, __ATOMIC_ACQUIRE) < RECEIVE_BUFFER_BYTES)
+            receive_buffer[tail++ % RECEIVE_BUFFER_BYTES] = byte;
+        else
+            uart_bytes_dropped++;
+    }
+
+    __atomic_store_n(&receive_tail, tail, __ATOMIC_RELEASE);
+
+    // Fill the FIFO from the transmit ring a burst at a time, only asking the UART how much room it has
+    // between bursts rather than before every byte
+
+    uint32 head = transmit_head;
+
+    while (true) {
+        while (true) {
+            uint32 waiting = __atomic_load_n(&transmit_tail, __ATOMIC_ACQUIRE) - head;
+            uint32 burst = uart_transmit_room();
+
+            if (burst > waiting)
+                burst = waiting;
+
+            if (burst == 0)
+                break;
+
+            for (; burst > 0; burst--)
+                uart_write_byte(transmit_buffer[head++ % TRANSMIT_BUFFER_BYTES]);
+        }
+
+        __atomic_store_n(&transmit_head, head, __ATOMIC_RELEASE);
+
+        // If there's more to send the FIFO is full, and the interrupt brings us back as it empties
+
+        if (head != __atomic_load_n(&transmit_tail, __ATOMIC_ACQUIRE))
+            break;
+
+        // Otherwise turn the transmit interrupt off. A sender may have added bytes (and turned it on) just
+        // before we did that, so look again after and go round once more if it did.
+
+        uart_transmit_interrupt(false);
+
+        asm volatile ("dmb sy" : : : "memory");
+
+        if (head == __atomic_load_n(&transmit_tail, __ATOMIC_ACQUIRE))
+            break;
+
+        uart_transmit_interrupt(true);
+    }
+
+#ifndef NO_MMU
+    __atomic_store_n(&servicing, 0, __ATOMIC_RELEASE);
+#endif
+
+    restore_interrupts(interrupts);
+}
+
+static void uart_interrupt(void *unused) {
+    service_uart();
+}
+
+static void uart_kicked(void *unused) {
+    clear_mailbox(UART_MAILBOX);
+
+    service_uart();
+}
+
+static uart_progress watch_uart() {
+    return (uart_progress) {transmit_head, read_timer()};
+}
+
+static void help_uart(uart_progress *progress) {
+    // For a core waiting on the UART, with IRQs masked. The main core services it itself, the others only
+    // step in if the main core hasn't moved anything in a while. Their own moves don't count as progress,
+    // so once they've started they keep going until the main core does something again.
+
+    if (this_core()->core == 0) {
+        service_uart();
+        return;
+    }
+
+    uint64 now = read_timer();
+
+    if (transmit_head != progress->head) {
+        progress->head = transmit_head;
+        progress->moved = now;
+        return;
+    }
+
+    if (now - progress->moved < timer_frequency() * UART_STALL_MICROSECONDS / 1000000)
+        return;
+
+    service_uart();
+
+    progress->head = transmit_head;
+}
+
+static void wait_for_uart() {
+    // Sleep until there's something to do instead of asking the UART over and over. Its interrupt comes to
+    // the main core and wakes a WFI there even while IRQs are masked (they must be, so one that comes in
+    // after we looked isn't missed). The other cores wait for the event stream, every 50us or so.
+
+    if (this_core()->core == 0)
+        wait_for_interrupt();
+    else
+        wait_for_event();
+}
+
+static void send_bytes(uint8 *bytes, uint16 length) {
+    acquire_lock(&sending);
+
+    uart_progress progress = watch_uart();
+    bool was_empty = __atomic_load_n(&transmit_head, __ATOMIC_ACQUIRE) == transmit_tail;
+
+    while (length > 0) {
+        uint32 tail = transmit_tail;
+        uint32 room = TRANSMIT_BUFFER_BYTES - (tail - __atomic_load_n(&transmit_head, __ATOMIC_ACQUIRE));
+
+        // Full, so wait for the interrupt to make room (or make it ourselves)
+
+        if (room == 0) {
+            help_uart(&progress);
+
+            if (transmit_tail - __atomic_load_n(&transmit_head, __ATOMIC_ACQUIRE) == TRANSMIT_BUFFER_BYTES)
+                wait_for_uart();                                    // We hold sending, so IRQs are masked
+
+            continue;
+        }
+
+        // Copy as much as fits before the ring wraps around
+
+        uint32 to_end = TRANSMIT_BUFFER_BYTES - tail % TRANSMIT_BUFFER_BYTES;
+        uint32 chunk = length < room ? length : room;
+
+        if (chunk > to_end)
+            chunk = to_end;
+
+        copy_memory((void *) bytes, (void *) &transmit_buffer[tail % TRANSMIT_BUFFER_BYTES], chunk);
+
+        __atomic_store_n(&transmit_tail, tail + chunk, __ATOMIC_RELEASE);
+
+        uart_transmit_interrupt(true);
+
+        bytes += chunk;
+        length -= chunk;
+    }
+
+    release_lock(&sending);
+
+    // The interrupt goes to the main core. If the UART was idle the main core has to fill the FIFO to get it
+    // going, the PL011 won't interrupt until it has drained some. If it's us with IRQs masked the interrupt
+    // can't reach us, so we send it all ourselves.
+
+    if (this_core()->core != 0) {
+        if (was_empty)
+            signal_mailbox(0, UART_MAILBOX);
+    } else if (!interrupts_enabled()) {
+        uart_flush();
+    } else {
+        service_uart();
+    }
+}
+
+// Functions
+
+void uart_init() {
+    init_uart_hardware();
+
+    register_irq_handler(UART_IRQ, uart_interrupt, null);
+    enable_irq_line(UART_IRQ);
+
+    // uart_init() runs on the main core, so that's where the mailbox is enabled
+
+    register_irq_handler(IRQ_LOCAL_MAILBOX_0 + UART_MAILBOX, uart_kicked, null);
+    enable_irq_line(IRQ_LOCAL_MAILBOX_0 + UART_MAILBOX);
+}
+
+void uart_flush() {
+    // IRQs come back on between sleeps, so whatever woke us runs and the thread can still be switched out
+
+    uart_progress progress = watch_uart();
+    bool flushed = false;
+
+    while (!flushed) {
+        uint64 interrupts = save_and_disable_interrupts();
+
+        help_uart(&progress);
+
+        flushed = transmit_head == transmit_tail;
+
+        if (!flushed)
+            wait_for_uart();
+
+        restore_interrupts(interrupts);
+    }
+}
+
+void uart_send_char(char c) {
+    send_bytes((uint8 *) &c, 1);
+}
+
+void uart_send_string(string *s) {
+    send_bytes((uint8 *) &s->data, s->size - 2);
+}
+
+char uart_receive_char() {
+    // Wait for the interrupt to bring a byte in. The main core goes and gets it itself too, the others leave
+    // that to its interrupt.
+
+    bool arrived = false;
+
+    while (!arrived) {
+        uint64 interrupts = save_and_disable_interrupts();
+
+        if (this_core()->core == 0)
+            service_uart();
+
+        arrived = receive_head != __atomic_load_n(&receive_tail, __ATOMIC_ACQUIRE);
+
+        if (!arrived)
+            wait_for_uart();
+
+        restore_interrupts(interrupts);
+    }
+
+    char c = receive_buffer[receive_head % RECEIVE_BUFFER_BYTES];
+
+    __atomic_store_n(&receive_head, receive_head + 1, __ATOMIC_RELEASE);
+
+    return c;
+}
+
+void uart_receive_string(string *dest, uint16 max_length, bool echo_on) {
+    uint8 *bytes = (uint8 *) &dest->data;
+    uint16 used = 0;
+
+    while (used < max_length) {
+        char c = uart_receive_char();
+
+        if (echo_on)
+            uart_send_char(c);
+
+        if (c == '\n' || c == '\r')
+            break;
+
+        bytes[used++] = c;
+    }
+
+    dest->size = used + 2;
+}
+
+void uart_send_word_in_hex(uint32 i, bool show_prefix) {
+    uint8 text[2 + 8] = {'0', 'x'};
+
+    write_hex(&text[2], i, 4);
+
+    if (show_prefix)
+        send_bytes(text, sizeof(text));
+    else
+        send_bytes(&text[2], sizeof(text) - 2);
+}
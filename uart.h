@@ -4,18 +4,30 @@
 #ifndef __uart_h__
 #define	__uart_h__
 
-// Initializes UART 1 so we can send/receive data
+// Sending only queues the bytes and returns, the UART's interrupt (on the main core, whichever core sent
+// them) sends them as it has room. If the ring is full, or it's the main core with IRQs masked, the calls
+// wait until it isn't, like the old polling ones did. Bytes that arrive are kept until they're asked for.
+// See uart.c.
+
+// Initializes the UART (the mini UART, or the PL011 with PL011=1) so we can send/receive data
+// IRQs have to be enabled for it to work in the background
 extern void uart_init();
 
 // Sends a single character
 extern void uart_send_char(char c);
 
-// Receives a single character
+// Receives a single character, only one core may be receiving at a time
 extern char uart_receive_char();
 
 // Sends a full string
 extern void uart_send_string(string *s);
 
+// Waits until everything that's been sent has gone to the UART
+void uart_flush();
+
+// How many bytes arrived with nowhere to put them
+extern uint64 uart_bytes_dropped;
+
 // Receives a string into the destination, up to max_length bytes long or a newline character is seen
 // Echo_on controls if characters are echoed back while being typed or no output is shown
 extern void uart_receive_string(string *dest, uint16 max_length, bool echo_on);
@@ -0,0 +1,137 @@
+#import "types.h"
+#import "memory.h"
+#import "string.h"
+#import "convert.h"
+#import "string_ops.h"
+#import "uart.h"
+#import "idle.h"
+#import "view.h"
+
+// Local functions
+
+static __attribute__((__noreturn__)) void panic_view_too_big() {
+    uart_send_string(LITERAL("View too big to make a string from"));
+
+    halt();
+}
+
+static bool is_space(uint8 c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Functions
+
+string_view view_of_string(string *s) {
+    return (string_view) {(uint8 *) &s->data, s->size - 2};
+}
+
+string *string_from_view(string_view view) {
+    if (view.length >= 0xFFFF - 2)
+        panic_view_too_big();
+
+    // Every byte gets written, so there's no need to zero it
+
+    string *result = allocate_uninitialized(view.length + 2);
+
+    result->size = view.length + 2;
+
+    copy_memory((void *) view.bytes, (void *) &result->data, view.length);
+
+    return result;
+}
+
+string_view slice_view(string_view view, uint16 start, uint16 length) {
+    if (start > view.length)
+        start = view.length;
+
+    if (length > view.length - start)
+        length = view.length - start;
+
+    return (string_view) {view.bytes + start, length};
+}
+
+string_view trim_view(string_view view) {
+    while (view.length > 0 && is_space(view.bytes[0])) {
+        view.bytes++;
+        view.length--;
+    }
+
+    while (view.length > 0 && is_space(view.bytes[view.length - 1]))
+        view.length--;
+
+    return view;
+}
+
+bool views_equal(string_view one, string_view two) {
+    return one.length == two.length && compare_bytes(one.bytes, two.bytes, one.length) == 0;
+}
+
+bool view_starts_with(string_view view, string_view prefix) {
+    return prefix.length <= view.length && views_equal(slice_view(view, 0, prefix.length), prefix);
+}
+
+string_view split_view(string_view *rest, uint8 separator) {
+    uint16 length = 0;
+
+    while (length < rest->length && rest->bytes[length] != separator)
+        length++;
+
+    string_view before = {rest->bytes, length};
+
+    // Skip the separator too, if we found one
+
+    if (length < rest->length)
+        length++;
+
+    rest->bytes += length;
+    rest->length -= length;
+
+    return before;
+}
+
+bool next_word(string_view *rest, string_view *word) {
+    *rest = trim_view(*rest);
+
+    if (rest->length == 0)
+        return false;
+
+    uint16 length = 0;
+
+    while (length < rest->length && !is_space(rest->bytes[length]))
+        length++;
+
+    *word = (string_view) {rest->bytes, length};
+
+    rest->bytes += length;
+    rest->length -= length;
+
+    return true;
+}
+
+bool view_to_number(string_view view, uint64 *number, bool *negative) {
+    uint16 used;
+
+    if (negative != null)
+        *negative = false;
+
+    if (view.length > 2 && view.bytes[0] == '0' && view.bytes[1] == 'x') {
+        *number = read_hex(view.bytes + 2, view.length - 2, &used);
+        used += 2;
+    } else if (view.length > 2 && view.bytes[0] == '0' && view.bytes[1] == 'b') {
+        *number = read_binary(view.bytes + 2, view.length - 2, &used);
+        used += 2;
+    } else if (view.length > 1 && view.bytes[0] == '-') {
+        if (negative == null)
+            return false;
+
+        *negative = true;
+        *number = (uint64) ((int64) -1 * (int64) read_decimal(view.bytes + 1, view.length - 1, &used));
+        used += 1;
+    } else {
+        *number = read_decimal(view.bytes, view.length, &used);
+    }
+
+    // It's only a number if every byte was part of it (and there was at least one digit)
+
+    return view.length > 0 && used == view.length;
+}
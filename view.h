@@ -0,0 +1,46 @@
+#include "types.h"
+#include "string.h"
+
+#ifndef __view_h__
+#define	__view_h__
+
+// A view is a look at some bytes that belong to someone else, usually part of a string. Slicing, splitting,
+// trimming and number parsing just move the pointer and length around, so none of them allocate or copy.
+// A view is only good as long as what it looks at is, make a string from it to keep the text.
+
+typedef struct {
+    uint8 *bytes;                       // The first byte we're looking at
+    uint16 length;                      // How many bytes we're looking at
+} string_view;
+
+// A view of the whole string
+string_view view_of_string(string *s);
+
+// Creates a new string with a copy of the bytes in the view
+string *string_from_view(string_view view);
+
+// A view of length bytes starting at start, cut short at the end of the view rather than running off it
+string_view slice_view(string_view view, uint16 start, uint16 length);
+
+// The view without any spaces, tabs, or line endings at either end
+string_view trim_view(string_view view);
+
+// True if both views hold the same bytes
+bool views_equal(string_view one, string_view two);
+
+// True if the view starts with the bytes in prefix
+bool view_starts_with(string_view view, string_view prefix);
+
+// Returns the bytes up to the first separator and moves rest past it. With no separator left it returns
+// all of rest and leaves rest empty.
+string_view split_view(string_view *rest, uint8 separator);
+
+// Skips spaces, tabs, and line endings then returns the word after them and moves rest past it.
+// Returns false when there are no words left.
+bool next_word(string_view *rest, string_view *word);
+
+// Parses the whole view as a number (binary, hex, or possibly negative integer) like parse_number().
+// Returns false rather than panicking if it isn't one, since views are mostly typed in by people.
+bool view_to_number(string_view view, uint64 *number, bool *negative);
+
+#endif